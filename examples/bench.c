@@ -0,0 +1,236 @@
+/*
+    librouteros-api - Connect to RouterOS devices using official API protocol
+    Copyright (C) 2012, Håkon Nessjøen <haakon.nessjoen@gmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Compares the loop engines against a mock RouterOS forked on a local port.
+   Every connection repeats the same command, and each reply has <rows> !re sentences. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include "../librouteros.h"
+
+#define MAX_CONNS 4096
+
+int requests_left;
+int requests_done;
+int sentences;
+
+static int add_word(unsigned char *dst, char *word) {
+	int len = strlen(word);
+
+	/* Only short words are used here */
+	dst[0] = len;
+	memcpy(dst + 1, word, len);
+	return len + 1;
+}
+
+/* Answers every complete sentence with the prepared reply */
+static void serve(int listener, int rows) {
+	static struct pollfd pfds[MAX_CONNS + 1];
+	static int fill[MAX_CONNS + 1];
+	static unsigned char in[MAX_CONNS + 1][1024];
+	unsigned char *reply = malloc(rows * 64 + 16);
+	int reply_len = 0, count = 1, i;
+
+	for (i = 0; i < rows; ++i) {
+		reply_len += add_word(reply + reply_len, "!re");
+		reply_len += add_word(reply + reply_len, "=name=ether1");
+		reply_len += add_word(reply + reply_len, "=mtu=1500");
+		reply_len += add_word(reply + reply_len, "=comment=bench");
+		reply[reply_len++] = 0;
+	}
+	reply_len += add_word(reply + reply_len, "!done");
+	reply[reply_len++] = 0;
+
+	pfds[0].fd = listener;
+	pfds[0].events = POLLIN;
+	while (poll(pfds, count, -1) >= 0) {
+		if (pfds[0].revents) {
+			/* Slots of closed connections are reused, so every run gets all of its connections */
+			for (i = 1; i < count && pfds[i].fd >= 0; ++i);
+			if (i <= MAX_CONNS) {
+				pfds[i].fd = accept(listener, NULL, NULL);
+				pfds[i].events = POLLIN;
+				pfds[i].revents = 0;
+				fill[i] = 0;
+				if (i == count) {
+					count++;
+				}
+			}
+		}
+		for (i = 1; i < count; ++i) {
+			int got, pos = 0;
+
+			if (pfds[i].revents == 0) {
+				continue;
+			}
+			got = read(pfds[i].fd, in[i] + fill[i], sizeof(in[i]) - fill[i]);
+			if (got <= 0) {
+				close(pfds[i].fd);
+				pfds[i].fd = -1;
+				continue;
+			}
+			fill[i] += got;
+			while (pos < fill[i]) {
+				int start = pos;
+				while (pos < fill[i] && in[i][pos] != 0) {
+					pos += in[i][pos] + 1;
+				}
+				if (pos >= fill[i]) {
+					pos = start;
+					break;
+				}
+				pos++;
+				if (write(pfds[i].fd, reply, reply_len) != reply_len) {
+					break;
+				}
+			}
+			memmove(in[i], in[i] + pos, fill[i] - pos);
+			fill[i] -= pos;
+		}
+	}
+	exit(0);
+}
+
+void handleReply(struct ros_result *result) {
+	sentences++;
+	if (result->done) {
+		requests_done++;
+		if (requests_left > 0) {
+			requests_left--;
+			ros_send_command(result->conn, "/interface/print", NULL);
+		}
+	}
+	ros_result_free(result);
+}
+
+static double now() {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void run(enum ros_engine engine, int port, int nconns, int requests) {
+	struct ros_connection **conns = calloc(nconns, sizeof(struct ros_connection *));
+	struct ros_loop *loop = ros_loop_new_engine(engine);
+	int i, started, iterations = 0, idle = 0;
+	double start;
+
+	if (loop == NULL) {
+		printf("%-9s  not available\n", engine == ROS_ENGINE_URING ? "io_uring" : "readiness");
+		free(conns);
+		return;
+	}
+
+	for (i = 0; i < nconns; ++i) {
+		conns[i] = ros_connect("127.0.0.1", port);
+		if (conns[i] == NULL) {
+			fprintf(stderr, "Error connecting: %s\n", strerror(errno));
+			exit(1);
+		}
+		ros_loop_add(loop, conns[i], handleReply);
+	}
+
+	requests_done = 0;
+	sentences = 0;
+	started = nconns < requests ? nconns : requests;
+	requests_left = requests - started;
+
+	start = now();
+	for (i = 0; i < started; ++i) {
+		ros_send_command(conns[i], "/interface/print", NULL);
+	}
+	while (requests_done < requests) {
+		int got = ros_loop_run_once(loop, 1000);
+
+		if (got < 0) {
+			break;
+		}
+		/* Gives up when nothing has arrived for five seconds */
+		idle = got > 0 ? 0 : idle + 1;
+		if (idle >= 5) {
+			fprintf(stderr, "No progress after %d of %d requests, giving up\n", requests_done, requests);
+			break;
+		}
+		iterations++;
+	}
+	start = now() - start;
+
+	printf("%-9s  %d requests  %.3f s  %.0f req/s  %.0f sentences/s  %d loop runs\n",
+		ros_loop_engine(loop) == ROS_ENGINE_URING ? "io_uring" : "readiness",
+		requests_done, start, requests_done / start, sentences / start, iterations);
+
+	for (i = 0; i < nconns; ++i) {
+		ros_disconnect(conns[i]);
+	}
+	ros_loop_free(loop);
+	free(conns);
+}
+
+int main(int argc, char **argv) {
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int listener, nconns, requests, rows;
+	pid_t server;
+
+	if (argc != 4) {
+		fprintf(stderr, "Usage: %s <connections> <requests> <rows per reply>\n", argv[0]);
+		return 1;
+	}
+	nconns = atoi(argv[1]);
+	requests = atoi(argv[2]);
+	rows = atoi(argv[3]);
+	if (nconns < 1 || nconns > MAX_CONNS || requests < 1 || rows < 0) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, MAX_CONNS) != 0 ||
+		getsockname(listener, (struct sockaddr *)&addr, &addrlen) != 0) {
+		fprintf(stderr, "Error starting mock server: %s\n", strerror(errno));
+		return 1;
+	}
+
+	server = fork();
+	if (server == 0) {
+		serve(listener, rows);
+	}
+	close(listener);
+
+	run(ROS_ENGINE_READINESS, ntohs(addr.sin_port), nconns, requests);
+	run(ROS_ENGINE_URING, ntohs(addr.sin_port), nconns, requests);
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,284 @@
+/*
+    librouteros-api - Connect to RouterOS devices using official API protocol
+    Copyright (C) 2012, Håkon Nessjøen <haakon.nessjoen@gmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Checks library behaviour against a scripted mock RouterOS forked on a local port.
+   Exits with 0 when every check passes. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include "../librouteros.h"
+
+int failures;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL line %d: %s\n", __LINE__, #cond); failures++; } } while (0)
+
+/* Reads one sentence of short words, returns the number of words or -1 on disconnect */
+static int read_sentence(FILE *in, char words[][256], int max) {
+	int count = 0, len;
+
+	while ((len = fgetc(in)) > 0) {
+		if (len >= 0x80 || count == max || fread(words[count], 1, len, in) != (size_t)len) {
+			return -1;
+		}
+		words[count++][len] = '\0';
+	}
+	return len < 0 ? -1 : count;
+}
+
+static void write_sentence(FILE *out, char **words, int count) {
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		fputc(strlen(words[i]), out);
+		fputs(words[i], out);
+	}
+	fputc(0, out);
+}
+
+/* Commands are left running until they are cancelled. "/cancels" tells how many /cancel were received */
+static void serve(int listener) {
+	char words[16][256], reply[64], tag[64], cancelled[64];
+	int client, count, i, cancels = 0;
+	FILE *in, *out;
+
+	while ((client = accept(listener, NULL, NULL)) >= 0) {
+		in = fdopen(client, "r");
+		out = fdopen(dup(client), "w");
+		while ((count = read_sentence(in, words, 16)) >= 0) {
+			char *done[] = { "!done", tag };
+			char *trap[] = { "!trap", "=category=2", "=message=interrupted", cancelled };
+			char *ended[] = { "!done", cancelled };
+			char *answer[] = { "!done", reply, tag };
+
+			if (count == 0) {
+				continue;
+			}
+			strcpy(tag, ".tag=");
+			strcpy(cancelled, ".tag=");
+			for (i = 1; i < count; ++i) {
+				if (strncmp(words[i], ".tag=", 5) == 0) {
+					strcpy(tag, words[i]);
+				} else if (strncmp(words[i], "=tag=", 5) == 0) {
+					strcpy(cancelled + 5, words[i] + 5);
+				}
+			}
+			if (strcmp(words[0], "/cancel") == 0) {
+				cancels++;
+				write_sentence(out, trap, 4);
+				write_sentence(out, ended, 2);
+				write_sentence(out, done, 2);
+			} else if (strcmp(words[0], "/burst") == 0) {
+				char *row[] = { "!re", "=name=row", tag };
+
+				for (i = 0; i < 3; ++i) {
+					write_sentence(out, row, 3);
+				}
+				write_sentence(out, done, 2);
+			} else if (strcmp(words[0], "/eq") == 0) {
+				char *row[] = { "!re", "=a=b=c", "=name=x", tag };
+
+				write_sentence(out, row, 4);
+				write_sentence(out, done, 2);
+			} else if (strcmp(words[0], "/login") == 0) {
+				write_sentence(out, done, 2);
+			} else if (strcmp(words[0], "/cancels") == 0) {
+				sprintf(reply, "=ret=%d", cancels);
+				write_sentence(out, answer, 3);
+			}
+			fflush(out);
+		}
+		fclose(in);
+		fclose(out);
+	}
+	exit(0);
+}
+
+int traps[16], dones[16], cancel_dones;
+
+void handleBatch(struct ros_result *result) {
+	if (result->tag >= 0 && result->tag < 16) {
+		traps[result->tag] += result->trap;
+		dones[result->tag] += result->done;
+	}
+	ros_result_free(result);
+}
+
+void handleCancel(struct ros_result *result) {
+	cancel_dones += result->done;
+	ros_result_free(result);
+}
+
+/* Cancels one request still in the pipeline backlog and one in flight, only the second reaches the router */
+static void check_cancel_backlog(int port) {
+	struct ros_connection *conn = ros_connect("127.0.0.1", port);
+	struct ros_sentence *sentences[5];
+	struct ros_result *res;
+	int ids[5], cancel[2], i, waits = 0;
+
+	for (i = 0; i < 5; ++i) {
+		sentences[i] = ros_sentence_new();
+		ros_sentence_add(sentences[i], "/listen");
+	}
+	ros_set_type(conn, ROS_EVENT);
+	ros_set_window(conn, 2);
+	CHECK(ros_send_batch(conn, handleBatch, sentences, 5, ids) == 5);
+	CHECK(ros_pipeline_pending(conn) == 3);
+
+	cancel[0] = ids[4];
+	cancel[1] = ids[0];
+	CHECK(ros_cancel_many(conn, cancel, 2, handleCancel) == 2);
+	CHECK(ros_pipeline_pending(conn) == 2);
+	CHECK(traps[ids[4]] == 1 && dones[ids[4]] == 1);
+	CHECK(cancel_dones == 1);
+
+	while ((cancel_dones < 2 || dones[ids[0]] == 0) && waits++ < 1000) {
+		ros_runloop_once(conn, NULL);
+		usleep(1000);
+	}
+	CHECK(traps[ids[0]] == 1 && dones[ids[0]] == 1);
+	CHECK(cancel_dones == 2);
+
+	/* The backlog moved up into the freed slot */
+	CHECK(ros_pipeline_pending(conn) == 1);
+
+	ros_set_type(conn, ROS_SIMPLE);
+	res = ros_send_command_wait(conn, "/cancels", NULL);
+	CHECK(res != NULL && ros_get(res, "=ret") != NULL && strcmp(ros_get(res, "=ret"), "1") == 0);
+	ros_result_free(res);
+
+	for (i = 0; i < 5; ++i) {
+		ros_sentence_free(sentences[i]);
+	}
+	ros_disconnect(conn);
+}
+
+struct ros_connection *burst_conn;
+int burst_rows;
+
+void handleBurst(struct ros_result *result) {
+	burst_rows++;
+	ros_result_free(result);
+	ros_disconnect(burst_conn);
+}
+
+/* A callback that disconnects stops the drain, the connection is freed once it returns */
+static void check_drain_disconnect(int port) {
+	int waits = 0, count = 0;
+
+	burst_conn = ros_connect("127.0.0.1", port);
+	ros_set_type(burst_conn, ROS_EVENT);
+	CHECK(ros_send_command_cb(burst_conn, handleBurst, "/burst", NULL) == 1);
+	while (burst_rows == 0 && count >= 0 && waits++ < 1000) {
+		count = ros_runloop_drain(burst_conn, NULL);
+		usleep(1000);
+	}
+	CHECK(count == -1);
+	CHECK(burst_rows == 1);
+}
+
+/* Keys with '=' in them find the same value whether the keys are interned or not */
+static void check_keys_inner_equals(int port) {
+	struct ros_connection *conn = ros_connect("127.0.0.1", port);
+	struct ros_keys *keys = ros_keys_new();
+	struct ros_result *res;
+	char *value;
+	int round;
+
+	for (round = 0; round < 2; ++round) {
+		if (round == 1) {
+			ros_set_keys(conn, keys);
+		}
+		res = ros_send_command_wait(conn, "/eq", NULL);
+		CHECK(res != NULL && res->re);
+		value = ros_get(res, "=a=b");
+		CHECK(value != NULL && strcmp(value, "c") == 0);
+		value = ros_get(res, "=a");
+		CHECK(value != NULL && strcmp(value, "b=c") == 0);
+		CHECK(ros_get(res, "=a=c") == NULL && ros_get(res, "=name=") == NULL);
+		while (res != NULL && !res->done) {
+			ros_result_free(res);
+			res = ros_read_packet(conn);
+		}
+		ros_result_free(res);
+	}
+	ros_disconnect(conn);
+	ros_keys_free(keys);
+}
+
+int login_result = -1;
+
+void loginDisconnect(struct ros_connection *conn, int success) {
+	login_result = success;
+	ros_disconnect(conn);
+}
+
+/* A login done that disconnects must be called after the runloop is done with the connection */
+static void check_login_disconnect(int port) {
+	struct ros_connection *conn = ros_connect("127.0.0.1", port);
+	int waits = 0;
+
+	ros_set_type(conn, ROS_EVENT);
+	CHECK(ros_login_async(conn, "admin", "", ROS_LOGIN_PLAIN, 0, loginDisconnect) == 1);
+	while (login_result < 0 && waits++ < 1000) {
+		ros_runloop_once(conn, NULL);
+		usleep(1000);
+	}
+	CHECK(login_result == 1);
+}
+
+int main(int argc, char **argv) {
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int listener;
+	pid_t server;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0 ||
+		getsockname(listener, (struct sockaddr *)&addr, &addrlen) != 0) {
+		fprintf(stderr, "Error starting mock server: %s\n", strerror(errno));
+		return 1;
+	}
+
+	server = fork();
+	if (server == 0) {
+		serve(listener);
+	}
+	close(listener);
+
+	check_cancel_backlog(ntohs(addr.sin_port));
+	check_login_disconnect(ntohs(addr.sin_port));
+	check_drain_disconnect(ntohs(addr.sin_port));
+	check_keys_inner_equals(ntohs(addr.sin_port));
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	printf(failures ? "%d checks failed\n" : "All checks passed\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,108 @@
+/*
+    librouteros-api - Connect to RouterOS devices using official API protocol
+    Copyright (C) 2012, Håkon Nessjøen <haakon.nessjoen@gmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "../librouteros.h"
+
+volatile int tasks = 0;
+struct ros_connection *conns[256];
+
+void handleUptime(struct ros_result *result) {
+	if (result->re) {
+		printf("%-16s  Uptime: %s  CPU load: %s%%\n", (char *)result->conn->userdata, ros_get(result, "=uptime"), ros_get(result, "=cpu-load"));
+	}
+
+	if (result->done) {
+		tasks--;
+	}
+	ros_result_free(result);
+}
+
+void handleDisconnect(struct ros_connection *conn) {
+	int i;
+
+	fprintf(stderr, "%s: disconnected\n", (char *)conn->userdata);
+	for (i = 0; i < 256; ++i) {
+		if (conns[i] == conn) {
+			conns[i] = NULL;
+		}
+	}
+	tasks--;
+	ros_disconnect(conn);
+}
+
+int main(int argc, char **argv) {
+	struct ros_loop *loop;
+	int i;
+
+	if (argc < 4 || argc > 256 + 3) {
+		fprintf(stderr, "Usage: %s <user> <password> <ip> [ip ...]\n", argv[0]);
+		return 1;
+	}
+
+	loop = ros_loop_new();
+	if (loop == NULL) {
+		fprintf(stderr, "Error creating event loop: %s\n", strerror(errno));
+		return 1;
+	}
+	ros_loop_set_disconnect(loop, handleDisconnect);
+
+	for (i = 3; i < argc; ++i) {
+		struct ros_connection *conn = ros_connect(argv[i], ROS_PORT);
+		if (conn == NULL) {
+			fprintf(stderr, "Error connecting to %s: %s\n", argv[i], strerror(errno));
+			continue;
+		}
+		if (!ros_login(conn, argv[1], argv[2])) {
+			fprintf(stderr, "Error logging in to %s\n", argv[i]);
+			ros_disconnect(conn);
+			continue;
+		}
+		conn->userdata = argv[i];
+		conns[i - 3] = conn;
+
+		/* NULL callback, so replies are dispatched to the ros_send_*_cb callbacks */
+		ros_loop_add(loop, conn, NULL);
+		ros_send_command_cb(conn, handleUptime, "/system/resource/print", "=.proplist=uptime,cpu-load", NULL);
+		tasks++;
+	}
+
+	while (tasks > 0) {
+		if (ros_loop_run_once(loop, 1000) < 0) {
+			break;
+		}
+	}
+
+	for (i = 0; i < 256; ++i) {
+		if (conns[i] != NULL) {
+			/* Also removes the connection from the loop */
+			ros_disconnect(conns[i]);
+		}
+	}
+	ros_loop_free(loop);
+
+	return 0;
+}
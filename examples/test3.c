@@ -105,8 +105,11 @@ int main(int argc, char **argv) {
 			reads = select(conn->socket + 1, &read_fds, NULL, NULL, &timeout);
 			if (reads > 0) {
 				if (FD_ISSET(conn->socket, &read_fds)) {
-					/* handle incoming data with specified callback */
-					ros_runloop_once(conn, NULL);
+					/* handle all available data with the callbacks given to ros_send_*_cb */
+					if (ros_runloop_drain(conn, NULL) < 0) {
+						/* Disconnected */
+						break;
+					}
 				}
 			}
 			if (tasks == 0) {
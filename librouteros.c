@@ -16,6 +16,9 @@
     with this program; if not, write to the Free Software Foundation, Inc.,
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#  define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #ifdef _WIN32
@@ -30,26 +33,84 @@
 #  include <errno.h>
 #  include <sys/uio.h>
 #  include <fcntl.h>
+#  include <poll.h>
+#  include <pthread.h>
+#  include <time.h>
+#  ifdef __linux__
+#    include <sys/epoll.h>
+#    if !defined(ROS_NO_URING) && defined(__has_include)
+#      if __has_include(<linux/io_uring.h>)
+#        define ROS_HAVE_URING
+#        include <sys/mman.h>
+#        include <sys/syscall.h>
+#        include <linux/time_types.h>
+#        include <linux/io_uring.h>
+#      endif
+#    endif
+#  endif
 #endif
 #include <string.h>
 #include <stdarg.h>
 #include "md5.h"
 #include "librouteros.h"
 
+static int ros_find_event(struct ros_connection *conn, int tag);
 static void ros_remove_event(struct ros_connection *conn, int index);
+static int ros_next_tag(struct ros_connection *conn);
+void ros_add_event(struct ros_connection *conn, struct ros_event *event);
+static int ros_send_words(struct ros_connection *conn, char **args, int *len, int num);
+static void ros_login_reply(struct ros_connection *conn, struct ros_result *result);
+static void ros_login_finish(struct ros_connection *conn, int success);
+static void ros_login_free(struct ros_login *login);
+static int ros_connection_close(struct ros_connection *conn);
+static int ros_pipeline_release(struct ros_connection *conn);
+static int ros_pipeline_cancel(struct ros_connection *conn, int tag);
+static struct ros_result *ros_result_local(struct ros_connection *conn, int tag, char *reply, char *message);
+static void inbuf_route(struct ros_connection *conn, struct ros_result *res, void (*callback)(struct ros_result *result));
+#ifdef ROS_HAVE_URING
+struct ros_uring_conn;
+static void ros_uring_queue(struct ros_uring_conn *uc);
+#endif
 
 static int debug = 0;
 
+#define ROS_READ_SIZE 65536
+
+/* Words a new sentence has room for before its arrays move to the heap */
+#define ROS_SENTENCE_WORDS 16
+
+/* Event records are allocated this many at a time */
+#define ROS_EVENT_SLAB 64
+
+/* Queueing delay in microseconds tolerated on top of twice the fastest reply before the window shrinks */
+#define ROS_WINDOW_SLACK 1000
+
+struct ros_event_slab {
+	struct ros_event_slab *next;
+	struct ros_event events[ROS_EVENT_SLAB];
+};
+
+/* Steps of the non-blocking login */
+#define ROS_LOGIN_STEP_PLAIN 0
+#define ROS_LOGIN_STEP_CHALLENGE 1
+#define ROS_LOGIN_STEP_RESPONSE 2
+
+struct ros_login {
+	enum ros_login_method method;
+	int step;
+	int tag;
+	char trapped;
+	/* Set once the outcome is known, done is then called when dispatching is over */
+	char finished;
+	int timeout;
+	int result;
+	void (*done)(struct ros_connection *conn, int success);
+	char *username;
+	char *password;
+};
+
 #ifdef _WIN32
 #define snprintf _snprintf
-static int is_connected (SOCKET socket) {
-	char data;
-	int len = recv(socket, &data, 1, MSG_PEEK);
-	if (len < 0) {
-		return WSAGetLastError() == WSAEWOULDBLOCK ? 1 : 0;
-	}
-	return len > 0 ? 1 : 0;
-}
 static int _read (SOCKET socket, char *data, int len) {
 	int rlen = recv(socket, data, len, 0);
 	if (rlen == SOCKET_ERROR) return -1;
@@ -61,777 +122,5071 @@ static int _write(SOCKET socket, char *data, int len) {
 	return wlen;
 }
 #else
-static int is_connected (int socket) {
-	char data;
-	int len = recv(socket, &data, 1, MSG_PEEK);
-	if (len < 0) {
-		return errno == EWOULDBLOCK ? 1 : 0;
-	}
-	return len > 0 ? 1 : 0;
-}
 #define _read(s,d,l) read(s,d,l)
 #define _write(s,d,l) write(s,d,l)
 #endif
 
-static int send_length(struct ros_connection *conn, int len) {
-	char data[4];
-	int written;
-	int towrite;
+#ifdef _WIN32
+#define socket_would_block() (WSAGetLastError() == WSAEWOULDBLOCK)
+#define socket_interrupted() (WSAGetLastError() == WSAEINTR)
+#else
+#define socket_would_block() (errno == EAGAIN || errno == EWOULDBLOCK)
+#define socket_interrupted() (errno == EINTR)
+#endif
 
-	if (len < 0x80) {
-		data[0] = (char)len;
-		written = _write(conn->socket, data, 1);
-		towrite = 1;
+/* Waits until the socket is readable (or writable), used by the blocking functions */
+static int wait_socket(struct ros_connection *conn, int for_write) {
+#ifdef _WIN32
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(conn->socket, &fds);
+	if (for_write) {
+		return select(0, NULL, &fds, NULL, NULL) > 0 ? 1 : 0;
 	}
-	else if (len < 0x4000) {
+	return select(0, &fds, NULL, NULL, NULL) > 0 ? 1 : 0;
+#else
+	struct pollfd pfd;
+	int ret;
 
-		len = htons(len);
-		memcpy(data, &len, 2);
-		data[0] |= 0x80;
+	pfd.fd = conn->socket;
+	pfd.events = for_write ? POLLOUT : POLLIN;
+	pfd.revents = 0;
+	do {
+		ret = poll(&pfd, 1, -1);
+	} while (ret < 0 && errno == EINTR);
+	return ret > 0 ? 1 : 0;
+#endif
+}
 
-		written = _write(conn->socket, data, 2);
-		towrite = 2;
+/* Encodes a word length prefix into dst, returns number of bytes used */
+static int encode_length(unsigned char *dst, unsigned int len) {
+	if (len < 0x80) {
+		dst[0] = len;
+		return 1;
 	}
- 	else if (len < 0x200000)
-	{
-		len = htonl(len);
-		memcpy(data, &len, 3);
-		data[0] |= 0xc0;
-		written = _write(conn->socket, data, 3);
-		towrite = 3;
+	else if (len < 0x4000) {
+		dst[0] = (len >> 8) | 0x80;
+		dst[1] = len;
+		return 2;
 	}
-	else if (len < 0x10000000)
-	{
-		len = htonl(len);
-		memcpy(data, &len, 4);
-		data[0] |= 0xe0;
-		written = _write(conn->socket, data, 4);
-		towrite = 4;
+	else if (len < 0x200000) {
+		dst[0] = (len >> 16) | 0xc0;
+		dst[1] = len >> 8;
+		dst[2] = len;
+		return 3;
 	}
-	else  // this should never happen
-	{
-		printf("length of word is %d\n", len);
-		printf("word is too long.\n");
-		exit(1);
+	else if (len < 0x10000000) {
+		dst[0] = (len >> 24) | 0xe0;
+		dst[1] = len >> 16;
+		dst[2] = len >> 8;
+		dst[3] = len;
+		return 4;
 	}
-	return written == towrite ? 1 : 0;
+	dst[0] = 0xf0;
+	dst[1] = len >> 24;
+	dst[2] = len >> 16;
+	dst[3] = len >> 8;
+	dst[4] = len;
+	return 5;
 }
 
-static int readLen(struct ros_connection *conn)
-{
-	char data[4];
+static void outbuf_reserve(struct ros_connection *conn, int needed) {
+	int size;
 
-	memset(data, 0, 4);
-	if (_read(conn->socket, data, 1) != 1) {
-		return -1;
+	if (conn->outbuf_len + needed <= conn->outbuf_size) {
+		return;
 	}
 
-	if ((data[0] & 0xE0) == 0xE0) {
-		if (_read(conn->socket, data + 1, 3) != 3) {
-			return -1;
+	/* Reclaim space already written out before growing */
+	if (conn->outbuf_pos > 0) {
+		memmove(conn->outbuf, conn->outbuf + conn->outbuf_pos, conn->outbuf_len - conn->outbuf_pos);
+		conn->outbuf_len -= conn->outbuf_pos;
+		conn->outbuf_pos = 0;
+		if (conn->outbuf_len + needed <= conn->outbuf_size) {
+			return;
 		}
-		printf("Giant packet: %d\n", *((int *)data));
-		return *((int *)data);
 	}
-	else if ((data[0] & 0xC0) == 0XC0) {
-		data[0] &= 0x3f;        // mask out the 1st 2 bits
-		if (_read(conn->socket, data + 1, 2) != 2) {
-			return -1;
+
+	size = conn->outbuf_size > 0 ? conn->outbuf_size : 1024;
+	while (size < conn->outbuf_len + needed) {
+		size *= 2;
+	}
+	conn->outbuf = realloc(conn->outbuf, size);
+	if (conn->outbuf == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	conn->outbuf_size = size;
+}
+
+int ros_flush(struct ros_connection *conn) {
+#ifdef ROS_HAVE_URING
+	/* Connections in an io_uring loop are sent by the loop on its next submit */
+	if (conn->uring != NULL) {
+		if (conn->outbuf_pos == conn->outbuf_len) {
+			return 1;
 		}
-		printf("Lesser small packet: %d\n", *((int *)data));
-		return *((int *)data);
+		ros_uring_queue(conn->uring);
+		return 0;
 	}
-	else if ((data[0] & 0x80) == 0x80) {
-		data[0] &= 0x7f;        // mask out the 1st bit
-		if (_read(conn->socket, data + 1, 1) != 1) {
+#endif
+	while (conn->outbuf_pos < conn->outbuf_len) {
+		int written = _write(conn->socket, (char *)conn->outbuf + conn->outbuf_pos, conn->outbuf_len - conn->outbuf_pos);
+		if (written < 0) {
+			if (socket_interrupted()) {
+				continue;
+			}
+			if (socket_would_block()) {
+				if (conn->type == ROS_EVENT) {
+					return 0;
+				}
+				if (wait_socket(conn, 1)) {
+					continue;
+				}
+			}
 			return -1;
 		}
-		printf("Less small packet: %d\n", *((int *)data));
-		return *((int *)data);
+		conn->outbuf_pos += written;
 	}
-	else {
-		return *((int *)data);
-	}
-	return 0;
+	conn->outbuf_pos = 0;
+	conn->outbuf_len = 0;
+	return 1;
 }
 
-static int md5toBin(unsigned char *dst, char *hex) {
-	int i;
-	char convert[3];
-	unsigned int data;
+int ros_pending_output(struct ros_connection *conn) {
+	return conn->outbuf_len - conn->outbuf_pos;
+}
 
-	if (strlen(hex) != 32)
+/* Decodes a word length prefix, returns number of bytes used, 0 if more data is needed and -1 if invalid */
+static int decode_length(unsigned char *src, int avail, unsigned int *len) {
+	if (avail < 1) {
 		return 0;
-
-	convert[2] = 0;
-	for(i = 0; i < 32; i+=2) {
-		memcpy(convert, hex + i, 2);
-		sscanf(convert, "%x", &data);
-		dst[i/2] = data & 0xff;
 	}
-	dst[i] = 0;
-
-	return 1;
+	if ((src[0] & 0x80) == 0) {
+		*len = src[0];
+		return 1;
+	}
+	else if ((src[0] & 0xc0) == 0x80) {
+		if (avail < 2) return 0;
+		*len = ((src[0] & 0x3f) << 8) | src[1];
+		return 2;
+	}
+	else if ((src[0] & 0xe0) == 0xc0) {
+		if (avail < 3) return 0;
+		*len = ((src[0] & 0x1f) << 16) | (src[1] << 8) | src[2];
+		return 3;
+	}
+	else if ((src[0] & 0xf0) == 0xe0) {
+		if (avail < 4) return 0;
+		*len = ((src[0] & 0x0f) << 24) | (src[1] << 16) | (src[2] << 8) | src[3];
+		return 4;
+	}
+	else if (src[0] == 0xf0) {
+		if (avail < 5) return 0;
+		*len = ((unsigned int)src[1] << 24) | (src[2] << 16) | (src[3] << 8) | src[4];
+		return 5;
+	}
+	return -1;
 }
 
-static int bintomd5(char *dst, unsigned char *bin) {
+/* Parses a decimal .tag value, returns 0 if it is not a number we could have generated */
+static int ros_parse_tag(const char *str, int len, int *tag) {
+	unsigned long value = 0;
 	int i;
 
-	for (i = 0; i < 16; ++i) {
-		sprintf(dst+(i<<1), "%02x", bin[i] & 0xFF);
+	if (len < 1 || len > 10) {
+		return 0;
 	}
-	dst[i<<1] = 0;
+	for (i = 0; i < len; ++i) {
+		unsigned int digit = (unsigned char)str[i] - '0';
+		if (digit > 9) {
+			return 0;
+		}
+		value = value * 10 + digit;
+	}
+	if (value > 0x7fffffff) {
+		return 0;
+	}
+	*tag = value;
 	return 1;
 }
 
-void ros_set_type(struct ros_connection *conn, enum ros_type type) {
-	int blocking = 0;
-	int flags;
+/* Writes value as decimal digits to dst, returns the number of characters */
+static int ros_format_tag(char *dst, unsigned int value) {
+	char digits[10];
+	int i = 0, len;
 
-	conn->type = type;
+	do {
+		digits[i++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
 
-	if (type == ROS_EVENT) {
-		blocking = 1;
+	len = i;
+	while (i > 0) {
+		*dst++ = digits[--i];
 	}
+	*dst = '\0';
+	return len;
+}
 
-#ifndef _WIN32
-	flags = fcntl(conn->socket, F_GETFL, 0);
-	if (flags < 0) {
-		fprintf(stderr, "Error getting socket flags\n");
+/* Makes room for at least needed bytes after inbuf_end, compacting before growing */
+static void inbuf_reserve(struct ros_connection *conn, int needed) {
+	int size;
+
+	if (conn->inbuf_start == conn->inbuf_end) {
+		conn->inbuf_start = conn->inbuf_end = 0;
+	}
+	else if (conn->inbuf_start > 0 && conn->inbuf_size - conn->inbuf_end < ROS_READ_SIZE / 4) {
+		memmove(conn->inbuf, conn->inbuf + conn->inbuf_start, conn->inbuf_end - conn->inbuf_start);
+		conn->inbuf_end -= conn->inbuf_start;
+		conn->inbuf_start = 0;
+	}
+
+	/* Only grows when a single sentence is larger than the buffer */
+	if (conn->inbuf_size - conn->inbuf_end >= needed) {
+		return;
+	}
+	size = conn->inbuf_size > 0 ? conn->inbuf_size * 2 : ROS_READ_SIZE;
+	while (size - conn->inbuf_end < needed) {
+		size *= 2;
+	}
+	conn->inbuf = realloc(conn->inbuf, size);
+	if (conn->inbuf == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
 		exit(1);
 	}
+	conn->inbuf_size = size;
+}
 
-	flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
-#endif
+/* Reads as much as the socket has into the receive buffer.
+   Returns bytes read, 0 on disconnect/error and -1 if the read would block */
+static int inbuf_fill(struct ros_connection *conn) {
+	int got;
 
-#ifdef _WIN32
-	if (ioctlsocket(conn->socket, FIONBIO, &blocking) == SOCKET_ERROR) {
-#else
-	if (fcntl(conn->socket, F_SETFL, flags) != 0) {
-#endif
-		fprintf(stderr, "Could not set socket to non-blocking mode\n");
-		exit(1);
+	inbuf_reserve(conn, 1);
+
+	do {
+		got = _read(conn->socket, (char *)conn->inbuf + conn->inbuf_end, conn->inbuf_size - conn->inbuf_end);
+	} while (got < 0 && socket_interrupted());
+
+	if (got < 0) {
+		return socket_would_block() ? -1 : 0;
 	}
+	conn->inbuf_end += got;
+	return got;
 }
 
-static void ros_handle_events(struct ros_connection *conn, struct ros_result *result) {
-	if (conn->max_events > 0) {
-		int i;
-		char *key = ros_get_tag(result);
-		if (key == NULL) {
-			/* Event with no tag */
-			return;
-		}
-		key = strdup(key);
-		if (key == NULL) {
-			fprintf(stderr, "Cannot allocate memory\n");
-			exit(1);
+/* Looks for a complete sentence at the start of the receive buffer. Returns its
+   size in bytes and number of words, 0 if incomplete and -1 on a protocol error.
+   Progress on an incomplete sentence is kept, so the tail is not scanned twice. */
+static int inbuf_scan(struct ros_connection *conn, int *words) {
+	unsigned char *start = conn->inbuf + conn->inbuf_start;
+	unsigned char *end = conn->inbuf + conn->inbuf_end;
+	unsigned char *pos = start + conn->scan_pos;
+	unsigned int len;
+	int used;
+
+	while ((used = decode_length(pos, end - pos, &len)) > 0) {
+		if (len == 0) {
+			*words = conn->scan_words;
+			conn->scan_pos = 0;
+			conn->scan_words = 0;
+			return pos + used - start;
 		}
-		for (i = 0; i < conn->max_events; ++i) {
-			if (conn->events[i]->inuse && strcmp(key, conn->events[i]->tag) == 0) {
-				if (result->done) {
-					ros_remove_event(conn, i);
-				}
-				conn->events[i]->callback(result);
-				free(key);
-				return;
-			}
+		if (len > (unsigned int)(end - pos - used)) {
+			return 0;
 		}
-		fprintf(stderr, "warning: unhandeled event with tag: %s\n", key);
-		ros_result_free(result);
-		free(key);
+		pos += used + len;
+		conn->scan_pos = pos - start;
+		conn->scan_words++;
 	}
+	return used;
 }
 
-int ros_runloop_once(struct ros_connection *conn, void (*callback)(struct ros_result *result)) {
-	/* Make sure the connection/instance is event based */
-	if (conn->type != ROS_EVENT) {
-		fprintf(stderr, "Warning! Connection type was not set to ROS_EVENT. Forcing change.\n");
-		ros_set_type(conn, ROS_EVENT);
+/* Reply words are told apart by length and one character, they are verified with memcmp() */
+static enum ros_reply ros_classify_reply(const char *word, int len) {
+	if (len < 3 || word[0] != '!') {
+		return ROS_REPLY_UNKNOWN;
 	}
-
-	if (!is_connected(conn->socket)) {
-		return 0;
+	switch (len) {
+		case 3:
+			if (word[1] == 'r' && word[2] == 'e') return ROS_REPLY_RE;
+			break;
+		case 5:
+			if (memcmp(word, "!done", 5) == 0) return ROS_REPLY_DONE;
+			if (memcmp(word, "!trap", 5) == 0) return ROS_REPLY_TRAP;
+			break;
+		case 6:
+			if (memcmp(word, "!fatal", 6) == 0) return ROS_REPLY_FATAL;
+			if (memcmp(word, "!empty", 6) == 0) return ROS_REPLY_EMPTY;
+			break;
 	}
+	return ROS_REPLY_UNKNOWN;
+}
 
-	if (conn->expected_length == 0) {
-		conn->expected_length = readLen(conn);
-		if (conn->expected_length > 0) {
-			conn->length = 0;
-			conn->buffer = malloc(sizeof(char) * (conn->expected_length + 1));
+/* Sets the reply kind, and the older flags that mirror it */
+static void ros_result_set_reply(struct ros_result *res, enum ros_reply reply) {
+	res->reply = reply;
+	res->done = reply == ROS_REPLY_DONE;
+	res->re = reply == ROS_REPLY_RE;
+	res->trap = reply == ROS_REPLY_TRAP;
+	res->fatal = reply == ROS_REPLY_FATAL;
+}
 
-			if (conn->buffer == NULL) {
-				fprintf(stderr, "Could not allocate memory for packet\n");
-				exit(1);
-			}
+#define ROS_ALIGN(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
 
-			/* Check for more data at once */
-			ros_runloop_once(conn, callback);
-		} else if (conn->expected_length == 0) {
-			// Sentence done
-			// call callback
-			struct ros_result *res = conn->event_result;
-			if (res->sentence->words > 0) {
-				if (strcmp(res->sentence->word[0], "!done") == 0) {
-					res->done = 1;
-				}
-				if (strcmp(res->sentence->word[0], "!re") == 0) {
-					res->re = 1;
-				}
-				if (strcmp(res->sentence->word[0], "!trap") == 0) {
-					res->trap = 1;
-				}
-				if (strcmp(res->sentence->word[0], "!fatal") == 0) {
-					res->fatal = 1;
-				}
-			}
-			if (debug) {
-				int i;
-				for (i = 0; i < res->sentence->words; ++i) {
-					printf("< %s\n", res->sentence->word[i]);
-				}
-			}
-			if (callback != NULL) {
-				callback(res);
-			} else {
-				ros_handle_events(conn, res);
-			}
-			conn->event_result = NULL;
-		}
-	} else {
-		int to_read = conn->expected_length - conn->length;
-		int got = _read(conn->socket, conn->buffer + conn->length, to_read);
-		if (got < 0) {
-			return 0;
-		}
-		if (got == to_read) {
-			struct ros_result *res;
-			if (conn->event_result == NULL) {
-				conn->event_result = malloc(sizeof(struct ros_result));
-				if (conn->event_result == NULL) {
-					fprintf(stderr, "Error allocating memory for event result\n");
-					exit(1);
-				}
-				memset(conn->event_result, 0, sizeof(struct ros_result));
-				conn->event_result->sentence = ros_sentence_new();
-				conn->event_result->done = 0;
-				conn->event_result->re = 0;
-				conn->event_result->trap = 0;
-				conn->event_result->fatal = 0;
-			}
-			res = conn->event_result;
-			conn->buffer[conn->length+to_read] = '\0';
-			ros_sentence_add(res->sentence, (char *)conn->buffer);
+/* Where the memory of a ros_result comes from */
+#define ROS_STORAGE_HEAP 0
+#define ROS_STORAGE_BLOCK 1
+#define ROS_STORAGE_ARENA 2
+#define ROS_STORAGE_POOL 3
 
-			free(conn->buffer);
-			conn->buffer = NULL;
-			conn->expected_length = 0;
-			conn->length = 0;
-		}
-	}
-	return 1;
-}
+/* Pooled blocks come in power of two sizes from 256 bytes to 512 KiB */
+#define ROS_POOL_MIN_SHIFT 8
 
-struct ros_connection *ros_connect(char *address, int port) {
-	struct sockaddr_in s_address;
-	struct ros_connection *conn = malloc(sizeof(struct ros_connection));
+/* Header in front of every pooled block */
+struct ros_pool_block {
+	struct ros_pool *pool;
+	struct ros_pool_block *next;
+	int cls;
+};
 
-#ifdef _WIN32
-	WSADATA wsaData;
-	int retval;
-#endif
+struct ros_pool *ros_pool_new(int max_free) {
+	struct ros_pool *pool = malloc(sizeof(struct ros_pool));
 
-	if (conn == NULL) {
+	if (pool == NULL) {
 		fprintf(stderr, "Error allocating memory\n");
 		exit(1);
 	}
+	memset(pool, 0, sizeof(struct ros_pool));
+	pool->max_free = max_free;
+	pool->refs = 1;
+	return pool;
+}
 
-#ifdef _WIN32
-	if ((retval = WSAStartup(0x202, &wsaData)) != 0) {
-		fprintf(stderr,"Server: WSAStartup() failed with error %d\n", retval);
-		free(conn);
-		return NULL;
-	}
-#endif
-
-	conn->expected_length = 0;
-	conn->length = 0;
-	conn->event_result = NULL;
-	conn->events = NULL;
-	conn->max_events = 0;
+static void ros_pool_unref(struct ros_pool *pool) {
+	int i;
 
-	conn->socket = socket(AF_INET, SOCK_STREAM, 0);
-	if (conn->socket <= 0) {
-#ifdef _WIN32
-		WSACleanup();
-#endif
-		free(conn);
-		return NULL;
+	if (--pool->refs > 0) {
+		return;
 	}
-
-	s_address.sin_family = AF_INET;
-	s_address.sin_addr.s_addr = inet_addr(address);
-	s_address.sin_port = htons(port);
-
-	if (
-		connect(conn->socket, (struct sockaddr *)&s_address, sizeof(s_address)) ==
-#ifdef _WIN32
-		SOCKET_ERROR
-#else
-		-1
-#endif
-	) {
-#ifdef _WIN32
-		closesocket(conn->socket);
-		WSACleanup();
-#else
-		close(conn->socket);
-#endif
-		free(conn);
-		return NULL;
+	for (i = 0; i < ROS_POOL_CLASSES; ++i) {
+		while (pool->free_list[i] != NULL) {
+			struct ros_pool_block *block = pool->free_list[i];
+			pool->free_list[i] = block->next;
+			free(block);
+		}
 	}
+	free(pool);
+}
 
-	return conn;
+void ros_pool_free(struct ros_pool *pool) {
+	if (pool != NULL) {
+		ros_pool_unref(pool);
+	}
 }
 
-int ros_disconnect(struct ros_connection *conn) {
-	int result = 0;
-#ifdef _WIN32
-	if (closesocket(conn->socket) == SOCKET_ERROR) {
-		result = -1;
+/* Returns a block with room for at least size bytes, or NULL if it is too big to be pooled */
+static void *ros_pool_get(struct ros_pool *pool, int size, int *capacity) {
+	struct ros_pool_block *block;
+	int cls = 0;
+
+	size += sizeof(struct ros_pool_block);
+	while ((1 << (cls + ROS_POOL_MIN_SHIFT)) < size) {
+		if (++cls == ROS_POOL_CLASSES) {
+			return NULL;
+		}
 	}
-#else
-	result = close(conn->socket);
-#endif
 
-	if (conn->max_events > 0) {
-		int i;
-		for (i = 0; i < conn->max_events; ++i) {
-			free(conn->events[i]);
-			conn->events[i] = NULL;
+	if (pool->free_list[cls] != NULL) {
+		block = pool->free_list[cls];
+		pool->free_list[cls] = block->next;
+		pool->free_count[cls]--;
+		pool->hits++;
+	} else {
+		block = malloc(1 << (cls + ROS_POOL_MIN_SHIFT));
+		if (block == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
 		}
-		free(conn->events);
-		conn->events = NULL;
+		block->pool = pool;
+		block->cls = cls;
+		pool->misses++;
 	}
-	free(conn);
-#ifdef _WIN32
-	WSACleanup();
-#endif
+	pool->refs++;
 
-	return result;
+	*capacity = (1 << (cls + ROS_POOL_MIN_SHIFT)) - sizeof(struct ros_pool_block);
+	return block + 1;
 }
 
-void ros_result_free(struct ros_result *result) {
-	ros_sentence_free(result->sentence);
-	result->sentence = NULL;
-	free(result);
-}
+static void ros_pool_put(void *ptr) {
+	struct ros_pool_block *block = (struct ros_pool_block *)ptr - 1;
+	struct ros_pool *pool = block->pool;
 
-int strcmp2(char *a, char *b) {
-	int i = 0;
-	while (1) {
-		if (a[i] == 0) {
-			return 1;
-		}
-		if (a[i] != b[i]) {
-			return 0;
-		}
-		i++;
+	/* Keep at most max_free blocks of each size, and none once only results hold the pool */
+	if (pool->free_count[block->cls] < pool->max_free && pool->refs > 1) {
+		block->next = pool->free_list[block->cls];
+		pool->free_list[block->cls] = block;
+		pool->free_count[block->cls]++;
+	} else {
+		free(block);
 	}
+	ros_pool_unref(pool);
 }
 
-char *ros_get_tag(struct ros_result *result) {
-	return ros_get(result, ".tag");
-}
+/* Bump allocation from an arena, returns NULL when it is full */
+static void *ros_arena_alloc(struct ros_arena *arena, int size) {
+	void *ptr;
 
-char *ros_get(struct ros_result *result, char *key) {
-	int i,keylen;
-	char *search;
-	if (result == NULL)
+	size = ROS_ALIGN(size);
+	if (arena->used + size > arena->size) {
 		return NULL;
+	}
+	ptr = arena->block + arena->used;
+	arena->used += size;
+	return ptr;
+}
+
+static unsigned int ros_hash_key(const char *key, int keylen);
+static int ros_word_keylen(const char *word, int len);
+
+struct ros_keys *ros_keys_new() {
+	struct ros_keys *keys = malloc(sizeof(struct ros_keys));
 
-	keylen = strlen(key);
-	search = malloc(sizeof(char) * (keylen + 2));
-	if (search == NULL) {
+	if (keys == NULL) {
 		fprintf(stderr, "Error allocating memory\n");
 		exit(1);
 	}
-	memcpy(search, key, keylen);
-	search[keylen] = '=';
-	search[keylen+1] = '\0';
-
-	for (i = 0; i < result->sentence->words; ++i) {
-		if (strcmp2(search, result->sentence->word[i])) {
-			free(search);
-			return result->sentence->word[i] + keylen + 1;
-		}
-	}
-	free(search);
-	return NULL;
+	memset(keys, 0, sizeof(struct ros_keys));
+	keys->refs = 1;
+	return keys;
 }
 
-struct ros_result *ros_read_packet(struct ros_connection *conn) {
-	struct ros_result *ret = malloc(sizeof(struct ros_result));
-	int len;
+static void ros_keys_unref(struct ros_keys *keys) {
+	int i;
 
-	if (ret == 0) {
-		fprintf(stderr, "Could not allocate memory.");
-		exit(1);
+	if (--keys->refs > 0) {
+		return;
 	}
+	for (i = 0; i < keys->count; ++i) {
+		free(keys->name[i]);
+	}
+	free(keys->name);
+	free(keys->namelen);
+	free(keys->index);
+	free(keys);
+}
 
-	memset(ret, 0, sizeof(struct ros_result));
-	ret->done = 0;
-	ret->re = 0;
-	ret->trap = 0;
-	ret->fatal = 0;
-	ret->sentence = ros_sentence_new();
+void ros_keys_free(struct ros_keys *keys) {
+	if (keys != NULL) {
+		ros_keys_unref(keys);
+	}
+}
 
-	do {
-		char *buffer;
-		len = readLen(conn);
-		if (len < 0) return NULL;
+/* Returns the id of a name, or -1 if it was never interned */
+static int ros_keys_find(struct ros_keys *keys, const char *name, int namelen) {
+	unsigned int mask = keys->index_size - 1, slot;
 
-		buffer = malloc(sizeof(char) * (len + 1));
-		if (buffer == NULL) {
-			fprintf(stderr, "Could not allocate memory.");
-			exit(1);
+	if (keys->index_size == 0) {
+		return -1;
+	}
+	slot = ros_hash_key(name, namelen) & mask;
+	while (keys->index[slot] >= 0) {
+		int id = keys->index[slot];
+		if (keys->namelen[id] == namelen && memcmp(keys->name[id], name, namelen) == 0) {
+			return id;
 		}
+		slot = (slot + 1) & mask;
+	}
+	return -1;
+}
+
+static void ros_keys_insert(struct ros_keys *keys, int id) {
+	unsigned int mask = keys->index_size - 1;
+	unsigned int slot = ros_hash_key(keys->name[id], keys->namelen[id]) & mask;
+
+	while (keys->index[slot] >= 0) {
+		slot = (slot + 1) & mask;
+	}
+	keys->index[slot] = id;
+}
+
+/* Returns the id of a name, interning it if needed */
+static int ros_keys_intern(struct ros_keys *keys, const char *name, int namelen) {
+	int id = ros_keys_find(keys, name, namelen), i;
+
+	if (id >= 0) {
+		return id;
+	}
+	if (keys->count == keys->max) {
+		keys->max = keys->max > 0 ? keys->max * 2 : 64;
+		keys->name = realloc(keys->name, sizeof(char *) * keys->max);
+		keys->namelen = realloc(keys->namelen, sizeof(int) * keys->max);
+		if (keys->name == NULL || keys->namelen == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+	}
+	id = keys->count++;
+	keys->name[id] = malloc(namelen + 1);
+	if (keys->name[id] == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	memcpy(keys->name[id], name, namelen);
+	keys->name[id][namelen] = '\0';
+	keys->namelen[id] = namelen;
+
+	/* Keeps the index at most half full */
+	if (keys->count * 2 > keys->index_size) {
+		keys->index_size = keys->index_size > 0 ? keys->index_size * 2 : 128;
+		free(keys->index);
+		keys->index = malloc(sizeof(int) * keys->index_size);
+		if (keys->index == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+		memset(keys->index, 0xff, sizeof(int) * keys->index_size);
+		for (i = 0; i < keys->count; ++i) {
+			ros_keys_insert(keys, i);
+		}
+	} else {
+		ros_keys_insert(keys, id);
+	}
+	return id;
+}
+
+/* Interns a name, given with or without its leading '=', and returns its id */
+int ros_key(struct ros_keys *keys, char *name) {
+	if (name[0] == '=') {
+		name++;
+	}
+	return ros_keys_intern(keys, name, strlen(name));
+}
+
+void ros_set_keys(struct ros_connection *conn, struct ros_keys *keys) {
+	if (keys != NULL) {
+		keys->refs++;
+	}
+	if (conn->keys != NULL) {
+		ros_keys_unref(conn->keys);
+	}
+	conn->keys = keys;
+}
+
+/* Frees memory a sentence holds outside of its own block, words added after it was received */
+static void ros_sentence_release(struct ros_sentence *sentence) {
+	int i;
+
+	for (i = sentence->data_words; i < sentence->words; ++i) {
+		free(sentence->word[i]);
+		sentence->word[i] = NULL;
+	}
+	if (sentence->arrays_heap) {
+		free(sentence->word);
+		free(sentence->len);
+	}
+	if (sentence->index_heap) {
+		free(sentence->index);
+	}
+	if (sentence->keys != NULL) {
+		ros_keys_unref(sentence->keys);
+	}
+	sentence->word = NULL;
+	sentence->len = NULL;
+	sentence->index = NULL;
+	sentence->key = NULL;
+	sentence->keys = NULL;
+}
+
+/* Bytes of "=key=" prefixes in a received sentence, which are not stored with interned keys */
+static int ros_sentence_keys_size(unsigned char *pos, int words) {
+	unsigned int len;
+	int i, keylen, total = 0;
+
+	for (i = 0; i < words; ++i) {
+		pos += decode_length(pos, 5, &len);
+		keylen = ros_word_keylen((char *)pos, len);
+		if (keylen > 1 && pos[0] == '=') {
+			total += keylen + 1;
+		}
+		pos += len;
+	}
+	return total;
+}
+
+/* Builds a result from a sentence found by inbuf_scan(), and consumes it from the buffer.
+   The result, sentence and all its words are carved from a single block of memory; either
+   a fresh allocation, or the connection arena when enabled. */
+static struct ros_result *inbuf_sentence(struct ros_connection *conn, int size, int words) {
+	struct ros_arena block, *arena = &block;
+	struct ros_result *res;
+	struct ros_sentence *sentence;
+	unsigned char *pos = conn->inbuf + conn->inbuf_start;
+	unsigned int len;
+	char *data;
+	int i, index_size, total, data_size = size;
+	char storage = ROS_STORAGE_BLOCK;
+	/* Results for a connection queue are read on other threads, so they keep plain words */
+	struct ros_keys *keys = conn->queue == NULL ? conn->keys : NULL;
+
+	/* Room for the key index is reserved up front, it is built on the first ros_get().
+	   With interned keys, key ids take its place */
+	if (keys != NULL) {
+		index_size = 0;
+		data_size -= ros_sentence_keys_size(pos, words);
+	} else {
+		for (index_size = 8; index_size < words * 2; index_size <<= 1);
+	}
+
+	/* Every word has at least one byte of length prefix, which leaves room for the terminating zeros */
+	total = ROS_ALIGN(sizeof(struct ros_result)) + ROS_ALIGN(sizeof(struct ros_sentence)) +
+		ROS_ALIGN(sizeof(char *) * words) + ROS_ALIGN(sizeof(int) * words) +
+		ROS_ALIGN(sizeof(unsigned short) * index_size) + ROS_ALIGN(data_size);
+	if (keys != NULL) {
+		total += ROS_ALIGN(sizeof(int) * words);
+	}
+
+	/* The connection arena only holds one result. Sentences read from inside a callback get their
+	   own block, and so do sentences for a queue, which may be freed on another thread */
+	if (conn->queue != NULL) {
+		block.block = malloc(total);
+		block.size = total;
+	} else if (conn->arena.block != NULL && conn->dispatch_depth == 0) {
+		if (conn->arena_result != NULL) {
+			ros_sentence_release(conn->arena_result->sentence);
+			conn->arena_result = NULL;
+		}
+		if (conn->arena.size < total) {
+			free(conn->arena.block);
+			conn->arena.size = total > conn->arena.size * 2 ? total : conn->arena.size * 2;
+			conn->arena.block = malloc(conn->arena.size);
+		}
+		arena = &conn->arena;
+		storage = ROS_STORAGE_ARENA;
+	} else if (conn->pool != NULL && (block.block = ros_pool_get(conn->pool, total, &block.size)) != NULL) {
+		storage = ROS_STORAGE_POOL;
+	} else {
+		block.block = malloc(total);
+		block.size = total;
+	}
+	if (arena->block == NULL) {
+		fprintf(stderr, "Could not allocate memory.");
+		exit(1);
+	}
+	arena->used = 0;
+
+	res = ros_arena_alloc(arena, sizeof(struct ros_result));
+	sentence = ros_arena_alloc(arena, sizeof(struct ros_sentence));
+	memset(res, 0, sizeof(struct ros_result));
+	res->storage = storage;
+	res->sentence = sentence;
+	res->tag = -1;
+	res->conn = conn;
+
+	sentence->word = ros_arena_alloc(arena, sizeof(char *) * words);
+	sentence->len = ros_arena_alloc(arena, sizeof(int) * words);
+	sentence->index = index_size > 0 ? ros_arena_alloc(arena, sizeof(unsigned short) * index_size) : NULL;
+	sentence->data = ros_arena_alloc(arena, data_size);
+	sentence->key = keys != NULL ? ros_arena_alloc(arena, sizeof(int) * words) : NULL;
+	sentence->keys = keys;
+	sentence->words = words;
+	sentence->max_words = words;
+	sentence->arrays_heap = 0;
+	sentence->data_words = words;
+	sentence->index_size = index_size;
+	sentence->index_words = 0;
+	sentence->index_heap = 0;
+	if (keys != NULL) {
+		keys->refs++;
+	}
+
+	data = sentence->data;
+	for (i = 0; i < words; ++i) {
+		int keylen;
+
+		pos += decode_length(pos, 5, &len);
+		if (keys != NULL) {
+			/* Only the value of "=key=value" is stored */
+			keylen = ros_word_keylen((char *)pos, len);
+			sentence->key[i] = -1;
+			if (keylen > 1 && pos[0] == '=') {
+				sentence->key[i] = ros_keys_intern(keys, (char *)pos + 1, keylen - 1);
+				pos += keylen + 1;
+				len -= keylen + 1;
+			}
+		}
+		memcpy(data, pos, len);
+		data[len] = '\0';
+		sentence->word[i] = data;
+		sentence->len[i] = len;
+		if (len > 5 && memcmp(data, ".tag=", 5) == 0 && !ros_parse_tag(data + 5, len - 5, &res->tag)) {
+			res->tag = -1;
+		}
+		data += len + 1;
+		pos += len;
+	}
+	conn->inbuf_start += size;
+	if (storage == ROS_STORAGE_ARENA) {
+		conn->arena_result = res;
+	}
+
+	if (words > 0) {
+		ros_result_set_reply(res, ros_classify_reply(sentence->word[0], sentence->len[0]));
+	}
+	if (debug) {
+		int i;
+		for (i = 0; i < res->sentence->words; ++i) {
+			if (keys != NULL && sentence->key[i] >= 0) {
+				printf("< =%s=%s\n", keys->name[sentence->key[i]], res->sentence->word[i]);
+			} else {
+				printf("< %s\n", res->sentence->word[i]);
+			}
+		}
+	}
+	return res;
+}
+
+static int md5toBin(unsigned char *dst, char *hex) {
+	int i;
+	char convert[3];
+	unsigned int data;
+
+	if (strlen(hex) != 32)
+		return 0;
+
+	convert[2] = 0;
+	for(i = 0; i < 32; i+=2) {
+		memcpy(convert, hex + i, 2);
+		sscanf(convert, "%x", &data);
+		dst[i/2] = data & 0xff;
+	}
+	dst[i] = 0;
+
+	return 1;
+}
+
+static int bintomd5(char *dst, unsigned char *bin) {
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		sprintf(dst+(i<<1), "%02x", bin[i] & 0xFF);
+	}
+	dst[i<<1] = 0;
+	return 1;
+}
+
+void ros_set_type(struct ros_connection *conn, enum ros_type type) {
+#ifdef _WIN32
+	u_long nonblocking = 0;
+#else
+	int nonblocking = 0;
+	int flags;
+#endif
+
+	conn->type = type;
+
+	if (type == ROS_EVENT) {
+		nonblocking = 1;
+	}
+
+#ifndef _WIN32
+	flags = fcntl(conn->socket, F_GETFL, 0);
+	if (flags < 0) {
+		fprintf(stderr, "Error getting socket flags\n");
+		exit(1);
+	}
+
+	flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+#endif
+
+#ifdef _WIN32
+	if (ioctlsocket(conn->socket, FIONBIO, &nonblocking) == SOCKET_ERROR) {
+#else
+	if (fcntl(conn->socket, F_SETFL, flags) != 0) {
+#endif
+		fprintf(stderr, "Could not set socket to non-blocking mode\n");
+		exit(1);
+	}
+}
+
+/* Monotonic clock in microseconds, for reply latencies */
+static long long ros_now_us() {
+#ifdef _WIN32
+	return (long long)GetTickCount() * 1000;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Additive increase while replies come back near the fastest seen, multiplicative decrease once the
+   router queues them. Changes at most once per window of replies, which is about one round trip */
+static void ros_window_adapt(struct ros_connection *conn, long long sample) {
+	if (conn->rtt_min == 0 || sample < conn->rtt_min) {
+		conn->rtt_min = sample;
+	}
+	conn->rtt_avg = conn->rtt_avg == 0 ? sample : conn->rtt_avg + (sample - conn->rtt_avg) / 8;
+
+	if (++conn->window_count < conn->window) {
+		return;
+	}
+	conn->window_count = 0;
+	if (conn->rtt_avg > conn->rtt_min * 2 + ROS_WINDOW_SLACK) {
+		conn->window = conn->window * 3 / 4;
+		if (conn->window < conn->window_min) {
+			conn->window = conn->window_min;
+		}
+	} else if (conn->window < conn->window_max) {
+		conn->window++;
+	}
+}
+
+/* A pipelined request got its !done, make room for the next */
+static void ros_pipeline_done(struct ros_connection *conn, struct ros_event *event) {
+	conn->inflight--;
+	/* Requests sent before the window became adaptive have no time to measure */
+	if (conn->window_max > 0 && event->sent != 0) {
+		ros_window_adapt(conn, ros_now_us() - event->sent);
+	}
+	if (ros_pipeline_release(conn) > 0) {
+		ros_flush(conn);
+	}
+}
+
+static void ros_handle_events(struct ros_connection *conn, struct ros_result *result) {
+	void (*callback)(struct ros_result *result);
+#ifndef _WIN32
+	struct ros_queue *queue;
+#endif
+	int index;
+
+	if (result->tag < 0) {
+		/* Event with no (numeric) tag */
+		char *key = ros_get_tag(result);
+		if (key != NULL) {
+			fprintf(stderr, "warning: unhandeled event with tag: %s\n", key);
+		}
+		ros_result_free(result);
+		return;
+	}
+	if ((index = ros_find_event(conn, result->tag)) < 0) {
+		fprintf(stderr, "warning: unhandeled event with tag: %d\n", result->tag);
+		ros_result_free(result);
+		return;
+	}
+
+	callback = conn->event_table[index]->callback;
+#ifndef _WIN32
+	queue = conn->event_table[index]->queue;
+#endif
+	if (result->done) {
+		if (conn->event_table[index]->pipelined) {
+			ros_pipeline_done(conn, conn->event_table[index]);
+		}
+		ros_remove_event(conn, index);
+	}
+#ifndef _WIN32
+	if (queue != NULL) {
+		ros_queue_push(queue, result);
+		return;
+	}
+#endif
+	callback(result);
+}
+
+/* Hands a received sentence to the login, the connection queue, the callback or the tag callbacks */
+static void inbuf_route(struct ros_connection *conn, struct ros_result *res, void (*callback)(struct ros_result *result)) {
+	conn->dispatch_depth++;
+	if (conn->login != NULL && !conn->login->finished && res->tag == conn->login->tag) {
+		ros_login_reply(conn, res);
+	} else if (res->tag > 0 && (res->tag == conn->login_tag || (conn->login != NULL && res->tag == conn->login->tag))) {
+		/* Late replies to a login that already timed out */
+		ros_result_free(res);
+	} else
+#ifndef _WIN32
+	if (conn->queue != NULL) {
+		ros_queue_push(conn->queue, res);
+	} else
+#endif
+	if (callback != NULL) {
+		callback(res);
+	} else {
+		ros_handle_events(conn, res);
+	}
+	conn->dispatch_depth--;
+}
+
+/* Dispatches every complete sentence in the receive buffer, returns how many or -1 on a protocol error */
+static int inbuf_dispatch(struct ros_connection *conn, void (*callback)(struct ros_result *result)) {
+	int size, words, count = 0;
+
+	while (!conn->closing && (size = inbuf_scan(conn, &words)) > 0) {
+		inbuf_route(conn, inbuf_sentence(conn, size, words), callback);
+		count++;
+	}
+	if (size < 0) {
+		fprintf(stderr, "Error: invalid word length received\n");
+		return -1;
+	}
+	return count;
+}
+
+/* Finishes what callbacks left for after dispatching: closes a connection they disconnected, or
+   reports a login outside a ros_loop. The connection may be freed afterwards */
+static void ros_dispatch_finish(struct ros_connection *conn) {
+	if (conn->dispatch_depth > 0) {
+		return;
+	}
+	if (conn->closing) {
+		ros_connection_close(conn);
+		return;
+	}
+#ifndef _WIN32
+	if (conn->loop != NULL) {
+		return;
+	}
+#endif
+	if (conn->login != NULL && conn->login->finished) {
+		ros_login_finish(conn, conn->login->result > 0);
+	}
+}
+
+int ros_runloop_once(struct ros_connection *conn, void (*callback)(struct ros_result *result)) {
+	int got;
+
+	/* Make sure the connection/instance is event based */
+	if (conn->type != ROS_EVENT) {
+		fprintf(stderr, "Warning! Connection type was not set to ROS_EVENT. Forcing change.\n");
+		ros_set_type(conn, ROS_EVENT);
+	}
+
+	got = inbuf_fill(conn);
+
+	if (inbuf_dispatch(conn, callback) < 0 || conn->closing) {
+		got = 0;
+	}
+	ros_dispatch_finish(conn);
+	return got == 0 ? 0 : 1;
+}
+
+int ros_runloop_drain(struct ros_connection *conn, void (*callback)(struct ros_result *result)) {
+	int got, dispatched, count = 0;
+
+	/* Make sure the connection/instance is event based */
+	if (conn->type != ROS_EVENT) {
+		fprintf(stderr, "Warning! Connection type was not set to ROS_EVENT. Forcing change.\n");
+		ros_set_type(conn, ROS_EVENT);
+	}
+
+	if (ros_pending_output(conn) > 0 && ros_flush(conn) < 0) {
+		return -1;
+	}
+
+	do {
+		got = inbuf_fill(conn);
+		dispatched = inbuf_dispatch(conn, callback);
+		if (dispatched < 0 || conn->closing) {
+			count = -1;
+			break;
+		}
+		count += dispatched;
+	} while (got > 0);
+
+	if (got == 0) {
+		count = -1;
+	}
+	ros_dispatch_finish(conn);
+	return count;
+}
+
+static struct ros_connection *ros_connection_new() {
+	struct ros_connection *conn = malloc(sizeof(struct ros_connection));
+
+	if (conn == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+
+	conn->type = ROS_SIMPLE;
+	conn->inbuf = NULL;
+	conn->inbuf_size = 0;
+	conn->inbuf_start = 0;
+	conn->inbuf_end = 0;
+	conn->scan_pos = 0;
+	conn->scan_words = 0;
+	conn->arena.block = NULL;
+	conn->arena.size = 0;
+	conn->arena.used = 0;
+	conn->arena_result = NULL;
+	conn->dispatch_depth = 0;
+	conn->pool = NULL;
+	conn->keys = NULL;
+	conn->outbuf = NULL;
+	conn->outbuf_size = 0;
+	conn->outbuf_len = 0;
+	conn->outbuf_pos = 0;
+	conn->window = 0;
+	conn->inflight = 0;
+	conn->backlog = NULL;
+	conn->backlog_size = 0;
+	conn->backlog_len = 0;
+	conn->backlog_pos = 0;
+	conn->backlog_count = 0;
+	conn->window_min = 0;
+	conn->window_max = 0;
+	conn->window_count = 0;
+	conn->rtt_min = 0;
+	conn->rtt_avg = 0;
+	conn->event_table = NULL;
+	conn->event_table_size = 0;
+	conn->event_count = 0;
+	conn->event_slabs = NULL;
+	conn->free_events = NULL;
+	conn->next_tag = 1;
+	conn->userdata = NULL;
+	conn->queue = NULL;
+#ifndef _WIN32
+	conn->loop = NULL;
+	conn->loop_callback = NULL;
+	conn->loop_index = 0;
+	conn->uring = NULL;
+	conn->shard = NULL;
+	conn->connecting = 0;
+	conn->deadline = 0;
+	conn->timer_index = -1;
+#endif
+	conn->login = NULL;
+	conn->closing = 0;
+	conn->login_tag = 0;
+	conn->socket = -1;
+	return conn;
+}
+
+#ifndef _WIN32
+/* Multi-connection event loop, epoll (edge triggered) on Linux and poll() elsewhere */
+
+#define ROS_LOOP_EVENTS 256
+
+struct ros_loop_ready {
+	struct ros_connection *conn;
+	char readable;
+	char writable;
+};
+
+struct ros_loop_dial {
+	struct ros_connection *conn;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	void (*callback)(struct ros_result *result);
+};
+
+struct ros_loop {
+	struct ros_connection **conns;
+	int count;
+	int size;
+	void (*disconnect)(struct ros_connection *conn);
+	/* Connections reported ready by the last wait, entries are cleared when removed */
+	struct ros_loop_ready *ready;
+	int ready_count;
+	int ready_size;
+	/* Pipe written by ros_loop_wakeup() */
+	int wake[2];
+	/* Connections with a deadline for a connect or login in progress */
+	struct ros_connection **timed;
+	int timed_count;
+	int timed_size;
+	/* Connects in progress, and dials waiting for a free slot */
+	int connecting_count;
+	int connect_timeout;
+	void (*connected)(struct ros_connection *conn, int error);
+	struct ros_loop_dial *dials;
+	int dial_head;
+	int dial_count;
+	int dial_size;
+	int dial_limit;
+#ifdef __linux__
+	int epfd;
+	struct epoll_event events[ROS_LOOP_EVENTS];
+#else
+	struct pollfd *pfds;
+#endif
+#ifdef ROS_HAVE_URING
+	struct ros_uring *uring;
+#endif
+};
+
+static int ros_loop_init_wakeup(struct ros_loop *loop) {
+	if (pipe(loop->wake) != 0) {
+		return 0;
+	}
+	fcntl(loop->wake[0], F_SETFL, fcntl(loop->wake[0], F_GETFL) | O_NONBLOCK);
+	fcntl(loop->wake[1], F_SETFL, fcntl(loop->wake[1], F_GETFL) | O_NONBLOCK);
+	return 1;
+}
+
+static void ros_loop_drain_wakeup(struct ros_loop *loop) {
+	char buf[64];
+
+	while (read(loop->wake[0], buf, sizeof(buf)) > 0);
+}
+
+/* Makes a ros_loop_run_once() blocked in another thread return, safe to call from any thread */
+void ros_loop_wakeup(struct ros_loop *loop) {
+	char c = 0;
+
+	/* A full pipe already has a wakeup pending */
+	if (write(loop->wake[1], &c, 1) < 0) {
+		return;
+	}
+}
+
+static long long ros_now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Parses a numeric IPv4 or IPv6 address, so no blocking name lookup is needed */
+static int ros_parse_address(char *address, int port, struct sockaddr_storage *addr, socklen_t *addrlen) {
+	struct sockaddr_in *in = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+
+	memset(addr, 0, sizeof(struct sockaddr_storage));
+	if (inet_pton(AF_INET, address, &in->sin_addr) == 1) {
+		in->sin_family = AF_INET;
+		in->sin_port = htons(port);
+		*addrlen = sizeof(struct sockaddr_in);
+		return 1;
+	}
+	if (inet_pton(AF_INET6, address, &in6->sin6_addr) == 1) {
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(port);
+		*addrlen = sizeof(struct sockaddr_in6);
+		return 1;
+	}
+	return 0;
+}
+
+/* Starts a non-blocking connect, returns 0 or an errno value */
+static int ros_connect_start(struct ros_connection *conn, struct sockaddr_storage *addr, socklen_t addrlen) {
+	int error;
+
+	conn->socket = socket(addr->ss_family, SOCK_STREAM, 0);
+	if (conn->socket < 0) {
+		conn->socket = -1;
+		return errno;
+	}
+	ros_set_type(conn, ROS_EVENT);
+	/* Completion is reported as writability even when connect() finishes at once */
+	if (connect(conn->socket, (struct sockaddr *)addr, addrlen) == 0 || errno == EINPROGRESS) {
+		conn->connecting = 1;
+		return 0;
+	}
+	error = errno;
+	close(conn->socket);
+	conn->socket = -1;
+	return error;
+}
+
+static void ros_loop_timer_at(struct ros_loop *loop, struct ros_connection *conn, long long deadline) {
+	if (conn->timer_index < 0) {
+		if (loop->timed_count == loop->timed_size) {
+			loop->timed_size = loop->timed_size > 0 ? loop->timed_size * 2 : 64;
+			loop->timed = realloc(loop->timed, sizeof(struct ros_connection *) * loop->timed_size);
+			if (loop->timed == NULL) {
+				fprintf(stderr, "Error allocating memory\n");
+				exit(1);
+			}
+		}
+		conn->timer_index = loop->timed_count;
+		loop->timed[loop->timed_count++] = conn;
+	}
+	conn->deadline = deadline;
+}
+
+/* Fails the connect or login in progress after timeout milliseconds */
+static void ros_loop_timer_set(struct ros_loop *loop, struct ros_connection *conn, int timeout) {
+	if (timeout > 0) {
+		ros_loop_timer_at(loop, conn, ros_now_ms() + timeout);
+	}
+}
+
+static void ros_loop_timer_clear(struct ros_loop *loop, struct ros_connection *conn) {
+	if (conn->timer_index < 0) {
+		return;
+	}
+	loop->timed[conn->timer_index] = loop->timed[--loop->timed_count];
+	loop->timed[conn->timer_index]->timer_index = conn->timer_index;
+	conn->timer_index = -1;
+	conn->deadline = 0;
+}
+
+static void ros_loop_unconnecting(struct ros_loop *loop, struct ros_connection *conn) {
+	conn->connecting = 0;
+	loop->connecting_count--;
+	ros_loop_timer_clear(loop, conn);
+}
+
+/* Reports a failed connect, the connection is not in the loop any more */
+static void ros_loop_connect_failed(struct ros_loop *loop, struct ros_connection *conn, int error) {
+	if (loop->connected != NULL) {
+		loop->connected(conn, error);
+	} else if (loop->disconnect != NULL) {
+		loop->disconnect(conn);
+	}
+}
+
+/* Reports a connection closed by the other end. A login still in progress reports it
+   through its done instead, unless it has none */
+static void ros_loop_closed(struct ros_loop *loop, struct ros_connection *conn) {
+	int login_done = conn->login != NULL && conn->login->done != NULL;
+
+	ros_loop_remove(loop, conn);
+	if (conn->login != NULL) {
+		ros_login_finish(conn, conn->login->finished && conn->login->result > 0);
+	}
+	if (!login_done && loop->disconnect != NULL) {
+		loop->disconnect(conn);
+	}
+}
+
+/* Called when a connecting socket becomes ready. The connection may be removed or freed by the handlers */
+static void ros_loop_connect_done(struct ros_loop *loop, struct ros_connection *conn) {
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if (getsockopt(conn->socket, SOL_SOCKET, SO_ERROR, &error, &len) != 0) {
+		error = errno;
+	}
+	ros_loop_unconnecting(loop, conn);
+	if (error == 0 && conn->login != NULL) {
+		ros_loop_timer_set(loop, conn, conn->login->timeout);
+	}
+	if (error != 0) {
+		ros_loop_remove(loop, conn);
+		ros_loop_connect_failed(loop, conn, error);
+	} else if (loop->connected != NULL) {
+		loop->connected(conn, 0);
+	}
+}
+
+/* Starts queued dials while under the concurrency limit */
+static void ros_loop_start_dials(struct ros_loop *loop) {
+	while (loop->dial_count > 0 && (loop->dial_limit <= 0 || loop->connecting_count < loop->dial_limit)) {
+		struct ros_loop_dial *dial = &loop->dials[loop->dial_head];
+		struct ros_connection *conn = dial->conn;
+		int error;
+
+		loop->dial_head = (loop->dial_head + 1) % loop->dial_size;
+		loop->dial_count--;
+
+		error = ros_connect_start(conn, &dial->addr, dial->addrlen);
+		if (error == 0 && !ros_loop_add(loop, conn, dial->callback)) {
+			error = errno;
+			close(conn->socket);
+			conn->socket = -1;
+			conn->connecting = 0;
+		}
+		if (error != 0) {
+			/* Without handlers nobody else would free it */
+			if (loop->connected == NULL && loop->disconnect == NULL) {
+				ros_disconnect(conn);
+			} else {
+				ros_loop_connect_failed(loop, conn, error);
+			}
+		}
+	}
+}
+
+/* Fails connects and logins past their deadline, and reports logins finished while dispatching */
+static void ros_loop_expire(struct ros_loop *loop) {
+	long long now = ros_now_ms();
+	int i = 0;
+
+	while (i < loop->timed_count) {
+		struct ros_connection *conn = loop->timed[i];
+
+		if (conn->deadline > now) {
+			i++;
+			continue;
+		}
+		ros_loop_timer_clear(loop, conn);
+		if (conn->connecting) {
+			ros_loop_remove(loop, conn);
+			ros_loop_connect_failed(loop, conn, ETIMEDOUT);
+		} else if (conn->login != NULL) {
+			ros_login_finish(conn, conn->login->result > 0);
+		}
+	}
+}
+
+/* Shortens a wait so it ends at the nearest connect deadline */
+static int ros_loop_timeout(struct ros_loop *loop, int timeout) {
+	long long now, deadline = 0;
+	int i;
+
+	for (i = 0; i < loop->timed_count; ++i) {
+		if (deadline == 0 || loop->timed[i]->deadline < deadline) {
+			deadline = loop->timed[i]->deadline;
+		}
+	}
+	if (deadline == 0) {
+		return timeout;
+	}
+	now = ros_now_ms();
+	if (deadline <= now) {
+		return 0;
+	}
+	if (timeout < 0 || deadline - now < timeout) {
+		return deadline - now;
+	}
+	return timeout;
+}
+
+#ifdef ROS_HAVE_URING
+/* io_uring engine. Every connection keeps a multishot recv posted that takes its
+   buffers from a ring shared by the loop, and the output of all connections is
+   sent with the same io_uring_enter() that waits for completions. */
+
+#define ROS_URING_ENTRIES 1024
+#define ROS_URING_BUFFERS 256
+#define ROS_URING_BUFFER_SIZE 16384
+#define ROS_URING_GROUP 0
+
+/* Operation kept in the low bits of the request user_data */
+#define ROS_URING_POLL 0
+#define ROS_URING_RECV 1
+#define ROS_URING_SEND 2
+#define ROS_URING_CANCEL 3
+#define ROS_URING_OP_MASK 3
+
+/* Outlives its connection until every operation posted for it has completed */
+struct ros_uring_conn {
+	struct ros_uring *ring;
+	struct ros_connection *conn;
+	int fd;
+	int inflight;
+	char poll_armed;
+	char recv_armed;
+	char multishot;
+	char sending;
+	char queued;
+	/* Output handed to the kernel, swapped with the connection outbuf */
+	unsigned char *sendbuf;
+	int sendbuf_size;
+	int send_pos;
+	int send_len;
+};
+
+struct ros_uring {
+	int fd;
+	void *rings;
+	size_t rings_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	unsigned char *buffers;
+	unsigned short buf_tail;
+	/* Connections that need a recv posted or have output to send */
+	struct ros_uring_conn **pending;
+	int pending_count;
+	int pending_size;
+	int states;
+	char wake_armed;
+};
+
+static void ros_uring_buffer_put(struct ros_uring *ring, int bid) {
+	struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (ROS_URING_BUFFERS - 1)];
+
+	buf->addr = (unsigned long)(ring->buffers + (size_t)bid * ROS_URING_BUFFER_SIZE);
+	buf->len = ROS_URING_BUFFER_SIZE;
+	buf->bid = bid;
+	ring->buf_tail++;
+}
+
+static void ros_uring_close(struct ros_uring *ring) {
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	if (ring->rings != NULL) {
+		munmap(ring->rings, ring->rings_size);
+	}
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->buf_ring != NULL) {
+		munmap(ring->buf_ring, ring->buf_ring_size);
+	}
+	free(ring->buffers);
+	free(ring->pending);
+	free(ring);
+}
+
+/* Returns NULL when the kernel lacks io_uring or any of the features used here */
+static struct ros_uring *ros_uring_new() {
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	struct ros_uring *ring = malloc(sizeof(struct ros_uring));
+	unsigned char *rings;
+	unsigned int *array;
+	size_t size;
+	int i;
+
+	if (ring == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	memset(ring, 0, sizeof(struct ros_uring));
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = ROS_URING_ENTRIES * 4;
+	ring->fd = syscall(__NR_io_uring_setup, ROS_URING_ENTRIES, &params);
+	if (ring->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+		goto fail;
+	}
+
+	ring->rings_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (size > ring->rings_size) {
+		ring->rings_size = size;
+	}
+	ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->rings == MAP_FAILED) {
+		ring->rings = NULL;
+		goto fail;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	rings = ring->rings;
+	ring->sq_head = (unsigned int *)(rings + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(rings + params.sq_off.tail);
+	ring->sq_mask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned int *)(rings + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(rings + params.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(rings + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+	/* Submission slots map one to one to entries */
+	array = (unsigned int *)(rings + params.sq_off.array);
+	for (i = 0; i < (int)params.sq_entries; ++i) {
+		array[i] = i;
+	}
+
+	ring->buf_ring_size = ROS_URING_BUFFERS * sizeof(struct io_uring_buf);
+	ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED) {
+		ring->buf_ring = NULL;
+		goto fail;
+	}
+	ring->buffers = malloc((size_t)ROS_URING_BUFFERS * ROS_URING_BUFFER_SIZE);
+	if (ring->buffers == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ring->buf_ring;
+	reg.ring_entries = ROS_URING_BUFFERS;
+	reg.bgid = ROS_URING_GROUP;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		goto fail;
+	}
+	for (i = 0; i < ROS_URING_BUFFERS; ++i) {
+		ros_uring_buffer_put(ring, i);
+	}
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+
+	return ring;
+
+fail:
+	ros_uring_close(ring);
+	return NULL;
+}
+
+/* Submits prepared requests and with wait set, waits up to timeout ms for a completion */
+static int ros_uring_enter(struct ros_uring *ring, int wait, int timeout) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = IORING_ENTER_EXT_ARG;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	memset(&arg, 0, sizeof(arg));
+	if (wait) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000L;
+			arg.ts = (unsigned long)&ts;
+		}
+	}
+	ret = syscall(__NR_io_uring_enter, ring->fd, ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE),
+		wait ? 1 : 0, flags, &arg, sizeof(arg));
+	if (ret < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN)) {
+		return 0;
+	}
+	return ret;
+}
+
+/* Returns a cleared submission entry, NULL if the queue stays full */
+static struct io_uring_sqe *ros_uring_sqe(struct ros_uring *ring) {
+	struct io_uring_sqe *sqe;
+
+	if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		ros_uring_enter(ring, 0, 0);
+		if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+			return NULL;
+		}
+	}
+	sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_local_tail++;
+	return sqe;
+}
+
+static void ros_uring_queue(struct ros_uring_conn *uc) {
+	struct ros_uring *ring = uc->ring;
+
+	if (uc->queued) {
+		return;
+	}
+	if (ring->pending_count == ring->pending_size) {
+		ring->pending_size = ring->pending_size > 0 ? ring->pending_size * 2 : 64;
+		ring->pending = realloc(ring->pending, sizeof(struct ros_uring_conn *) * ring->pending_size);
+		if (ring->pending == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+	}
+	ring->pending[ring->pending_count++] = uc;
+	uc->queued = 1;
+}
+
+/* Frees the state of a removed connection once nothing refers to it any more */
+static void ros_uring_release(struct ros_uring *ring, struct ros_uring_conn *uc) {
+	if (uc->conn != NULL || uc->inflight > 0 || uc->queued) {
+		return;
+	}
+	free(uc->sendbuf);
+	free(uc);
+	ring->states--;
+}
+
+/* Waits for a connect in progress to finish */
+static int ros_uring_post_poll(struct ros_uring *ring, struct ros_uring_conn *uc) {
+	struct io_uring_sqe *sqe = ros_uring_sqe(ring);
+
+	if (sqe == NULL) {
+		return 0;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = uc->fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->user_data = (unsigned long)uc | ROS_URING_POLL;
+	uc->poll_armed = 1;
+	uc->inflight++;
+	return 1;
+}
+
+static int ros_uring_post_recv(struct ros_uring *ring, struct ros_uring_conn *uc) {
+	struct io_uring_sqe *sqe = ros_uring_sqe(ring);
+
+	if (sqe == NULL) {
+		return 0;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = uc->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = ROS_URING_GROUP;
+	sqe->ioprio = uc->multishot ? IORING_RECV_MULTISHOT : 0;
+	sqe->user_data = (unsigned long)uc | ROS_URING_RECV;
+	uc->recv_armed = 1;
+	uc->inflight++;
+	return 1;
+}
+
+static int ros_uring_post_send(struct ros_uring *ring, struct ros_uring_conn *uc) {
+	struct ros_connection *conn = uc->conn;
+	struct io_uring_sqe *sqe;
+
+	if (uc->send_pos == uc->send_len) {
+		unsigned char *buf = uc->sendbuf;
+		int size = uc->sendbuf_size;
+
+		if (ros_pending_output(conn) == 0) {
+			return 1;
+		}
+		/* The kernel reads from sendbuf while new commands go to the other buffer */
+		uc->sendbuf = conn->outbuf;
+		uc->sendbuf_size = conn->outbuf_size;
+		uc->send_pos = conn->outbuf_pos;
+		uc->send_len = conn->outbuf_len;
+		conn->outbuf = buf;
+		conn->outbuf_size = size;
+		conn->outbuf_pos = 0;
+		conn->outbuf_len = 0;
+	}
+
+	sqe = ros_uring_sqe(ring);
+	if (sqe == NULL) {
+		return 0;
+	}
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = uc->fd;
+	sqe->addr = (unsigned long)(uc->sendbuf + uc->send_pos);
+	sqe->len = uc->send_len - uc->send_pos;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long)uc | ROS_URING_SEND;
+	uc->sending = 1;
+	uc->inflight++;
+	return 1;
+}
+
+static void ros_uring_post_cancel(struct ros_uring *ring, struct ros_uring_conn *uc, int op) {
+	struct io_uring_sqe *sqe = ros_uring_sqe(ring);
+
+	if (sqe == NULL) {
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (unsigned long)uc | op;
+	sqe->user_data = (unsigned long)uc | ROS_URING_CANCEL;
+	uc->inflight++;
+}
+
+/* Prepares recvs and sends for queued connections, keeping those the queue had no room for */
+static void ros_uring_prepare(struct ros_uring *ring) {
+	int i, kept = 0;
+
+	for (i = 0; i < ring->pending_count; ++i) {
+		struct ros_uring_conn *uc = ring->pending[i];
+		int done = 1;
+
+		if (uc->conn != NULL && uc->conn->connecting) {
+			if (!uc->poll_armed && !ros_uring_post_poll(ring, uc)) {
+				done = 0;
+			}
+		} else if (uc->conn != NULL) {
+			if (!uc->recv_armed && !ros_uring_post_recv(ring, uc)) {
+				done = 0;
+			}
+			if (!uc->sending && !ros_uring_post_send(ring, uc)) {
+				done = 0;
+			}
+		}
+		if (done) {
+			uc->queued = 0;
+			ros_uring_release(ring, uc);
+		} else {
+			ring->pending[kept++] = uc;
+		}
+	}
+	ring->pending_count = kept;
+}
+
+static void ros_uring_add(struct ros_uring *ring, struct ros_connection *conn) {
+	struct ros_uring_conn *uc = malloc(sizeof(struct ros_uring_conn));
+
+	if (uc == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	memset(uc, 0, sizeof(struct ros_uring_conn));
+	uc->ring = ring;
+	uc->conn = conn;
+	uc->fd = conn->socket;
+	uc->multishot = 1;
+	conn->uring = uc;
+	ring->states++;
+	ros_uring_queue(uc);
+}
+
+static void ros_uring_remove(struct ros_uring *ring, struct ros_connection *conn) {
+	struct ros_uring_conn *uc = conn->uring;
+
+	conn->uring = NULL;
+	uc->conn = NULL;
+	if (uc->poll_armed) {
+		ros_uring_post_cancel(ring, uc, ROS_URING_POLL);
+	}
+	if (uc->recv_armed) {
+		ros_uring_post_cancel(ring, uc, ROS_URING_RECV);
+	}
+	if (uc->sending) {
+		ros_uring_post_cancel(ring, uc, ROS_URING_SEND);
+	}
+	/* Submit now, the socket is usually closed right after this */
+	if (uc->inflight > 0) {
+		ros_uring_enter(ring, 0, 0);
+	}
+	ros_uring_release(ring, uc);
+}
+
+static void ros_uring_disconnect(struct ros_loop *loop, struct ros_connection *conn) {
+	ros_loop_closed(loop, conn);
+}
+
+/* Handles every available completion, returns the number of sentences dispatched */
+static int ros_uring_reap(struct ros_loop *loop) {
+	struct ros_uring *ring = loop->uring;
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	int total = 0;
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+		struct ros_uring_conn *uc = (struct ros_uring_conn *)(unsigned long)(cqe->user_data & ~(unsigned long long)ROS_URING_OP_MASK);
+		int op = cqe->user_data & ROS_URING_OP_MASK;
+		int res = cqe->res;
+		unsigned int flags = cqe->flags;
+		int finished = 1;
+
+		head++;
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		/* The wakeup pipe poll has no connection state */
+		if (uc == NULL) {
+			if (!(flags & IORING_CQE_F_MORE)) {
+				ring->wake_armed = 0;
+			}
+			ros_loop_drain_wakeup(loop);
+			continue;
+		}
+
+		if (op == ROS_URING_POLL) {
+			uc->poll_armed = 0;
+			if (uc->conn != NULL && uc->conn->connecting) {
+				ros_loop_connect_done(loop, uc->conn);
+			}
+			if (uc->conn != NULL) {
+				ros_uring_queue(uc);
+			}
+		}
+		else if (op == ROS_URING_RECV) {
+			if (flags & IORING_CQE_F_MORE) {
+				finished = 0;
+			} else {
+				uc->recv_armed = 0;
+			}
+			if (flags & IORING_CQE_F_BUFFER) {
+				int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+				if (res > 0 && uc->conn != NULL) {
+					inbuf_reserve(uc->conn, res);
+					memcpy(uc->conn->inbuf + uc->conn->inbuf_end, ring->buffers + (size_t)bid * ROS_URING_BUFFER_SIZE, res);
+					uc->conn->inbuf_end += res;
+				}
+				ros_uring_buffer_put(ring, bid);
+			}
+			if (uc->conn != NULL) {
+				if (res > 0) {
+					struct ros_connection *conn = uc->conn;
+					int count = inbuf_dispatch(conn, conn->loop_callback);
+					if (conn->closing) {
+						/* Disconnected by one of its callbacks */
+						ros_dispatch_finish(conn);
+					} else if (count < 0) {
+						ros_uring_disconnect(loop, conn);
+					} else {
+						total += count;
+					}
+				} else if (res == -EINVAL && uc->multishot) {
+					/* Kernel without multishot recv, post one at a time */
+					uc->multishot = 0;
+				} else if (res != -ENOBUFS && res != -EINTR && res != -EAGAIN) {
+					ros_uring_disconnect(loop, uc->conn);
+				}
+			}
+			if (uc->conn != NULL && !uc->recv_armed) {
+				ros_uring_queue(uc);
+			}
+		}
+		else if (op == ROS_URING_SEND) {
+			uc->sending = 0;
+			if (uc->conn != NULL) {
+				if (res >= 0) {
+					uc->send_pos += res;
+					if (uc->send_pos == uc->send_len) {
+						uc->send_pos = uc->send_len = 0;
+					}
+					if (uc->send_pos < uc->send_len || ros_pending_output(uc->conn) > 0) {
+						ros_uring_queue(uc);
+					}
+				} else if (res == -EINTR || res == -EAGAIN) {
+					ros_uring_queue(uc);
+				} else {
+					ros_uring_disconnect(loop, uc->conn);
+				}
+			}
+		}
+
+		if (finished) {
+			uc->inflight--;
+			ros_uring_release(ring, uc);
+		}
+	}
+
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+	return total;
+}
+
+static void ros_uring_post_wake(struct ros_loop *loop) {
+	struct io_uring_sqe *sqe = ros_uring_sqe(loop->uring);
+
+	if (sqe == NULL) {
+		return;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = loop->wake[0];
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = 0;
+	loop->uring->wake_armed = 1;
+}
+
+static int ros_uring_run(struct ros_loop *loop, int timeout) {
+	if (!loop->uring->wake_armed) {
+		ros_uring_post_wake(loop);
+	}
+	ros_uring_prepare(loop->uring);
+	if (ros_uring_enter(loop->uring, 1, timeout) < 0) {
+		return -1;
+	}
+	return ros_uring_reap(loop);
+}
+
+/* Waits for the operations of removed connections before the ring goes away */
+static void ros_uring_free(struct ros_loop *loop) {
+	struct ros_uring *ring = loop->uring;
+	int tries = 0;
+
+	while (ring->states > 0 && tries++ < 100) {
+		ros_uring_prepare(ring);
+		if (ros_uring_enter(ring, 1, 10) < 0) {
+			break;
+		}
+		ros_uring_reap(loop);
+	}
+	ros_uring_close(ring);
+	loop->uring = NULL;
+}
+#endif
+
+struct ros_loop *ros_loop_new() {
+	struct ros_loop *loop = malloc(sizeof(struct ros_loop));
+
+	if (loop == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	memset(loop, 0, sizeof(struct ros_loop));
+	if (!ros_loop_init_wakeup(loop)) {
+		free(loop);
+		return NULL;
+	}
+#ifdef __linux__
+	loop->epfd = epoll_create(ROS_LOOP_EVENTS);
+	if (loop->epfd >= 0) {
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = loop;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake[0], &ev) != 0) {
+			close(loop->epfd);
+			loop->epfd = -1;
+		}
+	}
+	if (loop->epfd < 0) {
+		close(loop->wake[0]);
+		close(loop->wake[1]);
+		free(loop);
+		return NULL;
+	}
+#else
+	loop->pfds = malloc(sizeof(struct pollfd));
+	if (loop->pfds == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+#endif
+	return loop;
+}
+
+/* ROS_ENGINE_AUTO uses io_uring when the kernel supports it and readiness I/O otherwise */
+struct ros_loop *ros_loop_new_engine(enum ros_engine engine) {
+#ifdef ROS_HAVE_URING
+	struct ros_loop *loop;
+#endif
+
+	if (engine == ROS_ENGINE_READINESS) {
+		return ros_loop_new();
+	}
+#ifdef ROS_HAVE_URING
+	loop = malloc(sizeof(struct ros_loop));
+	if (loop == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	memset(loop, 0, sizeof(struct ros_loop));
+	loop->epfd = -1;
+	if (ros_loop_init_wakeup(loop)) {
+		loop->uring = ros_uring_new();
+		if (loop->uring != NULL) {
+			return loop;
+		}
+		close(loop->wake[0]);
+		close(loop->wake[1]);
+	}
+	free(loop);
+#endif
+	if (engine == ROS_ENGINE_URING) {
+		return NULL;
+	}
+	return ros_loop_new();
+}
+
+enum ros_engine ros_loop_engine(struct ros_loop *loop) {
+#ifdef ROS_HAVE_URING
+	if (loop->uring != NULL) {
+		return ROS_ENGINE_URING;
+	}
+#endif
+	return ROS_ENGINE_READINESS;
+}
+
+void ros_loop_set_disconnect(struct ros_loop *loop, void (*disconnect)(struct ros_connection *conn)) {
+	loop->disconnect = disconnect;
+}
+
+/* Registers a connection, callback works like the one given to ros_runloop_once() */
+int ros_loop_add(struct ros_loop *loop, struct ros_connection *conn, void (*callback)(struct ros_result *result)) {
+#ifdef __linux__
+	struct epoll_event ev;
+#endif
+
+	if (conn->loop != NULL) {
+		return 0;
+	}
+	if (conn->type != ROS_EVENT) {
+		ros_set_type(conn, ROS_EVENT);
+	}
+
+	if (loop->count == loop->size) {
+		int size = loop->size > 0 ? loop->size * 2 : 64;
+		loop->conns = realloc(loop->conns, sizeof(struct ros_connection *) * size);
+#ifndef __linux__
+		/* One more for the wakeup pipe */
+		loop->pfds = realloc(loop->pfds, sizeof(struct pollfd) * (size + 1));
+		if (loop->pfds == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+#endif
+		loop->ready = realloc(loop->ready, sizeof(struct ros_loop_ready) * size);
+		if (loop->conns == NULL || loop->ready == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+		loop->size = size;
+		loop->ready_size = size;
+	}
+
+#ifdef __linux__
+	if (loop->epfd >= 0) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = conn;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->socket, &ev) != 0) {
+			return 0;
+		}
+	}
+#endif
+
+	conn->loop = loop;
+	conn->loop_callback = callback;
+	conn->loop_index = loop->count;
+	loop->conns[loop->count++] = conn;
+	if (conn->connecting) {
+		loop->connecting_count++;
+		ros_loop_timer_set(loop, conn, loop->connect_timeout);
+	} else if (conn->login != NULL && conn->login->finished) {
+		ros_loop_timer_at(loop, conn, 0);
+	} else if (conn->login != NULL) {
+		ros_loop_timer_set(loop, conn, conn->login->timeout);
+	}
+#ifdef ROS_HAVE_URING
+	if (loop->uring != NULL) {
+		ros_uring_add(loop->uring, conn);
+	}
+#endif
+	return 1;
+}
+
+int ros_loop_remove(struct ros_loop *loop, struct ros_connection *conn) {
+	int i;
+
+	if (conn->loop != loop) {
+		return 0;
+	}
+	if (conn->connecting) {
+		ros_loop_unconnecting(loop, conn);
+	}
+	ros_loop_timer_clear(loop, conn);
+#ifdef __linux__
+	if (loop->epfd >= 0) {
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->socket, NULL);
+	}
+#endif
+#ifdef ROS_HAVE_URING
+	if (loop->uring != NULL) {
+		ros_uring_remove(loop->uring, conn);
+	}
+#endif
+
+	/* Forget pending readiness, the connection may be freed after this */
+	for (i = 0; i < loop->ready_count; ++i) {
+		if (loop->ready[i].conn == conn) {
+			loop->ready[i].conn = NULL;
+		}
+	}
+
+	loop->conns[conn->loop_index] = loop->conns[--loop->count];
+	loop->conns[conn->loop_index]->loop_index = conn->loop_index;
+	conn->loop = NULL;
+	conn->loop_callback = NULL;
+	return 1;
+}
+
+static int ros_loop_wait(struct ros_loop *loop, int timeout) {
+	int i, n;
+
+#ifdef __linux__
+	do {
+		n = epoll_wait(loop->epfd, loop->events, ROS_LOOP_EVENTS, timeout);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		return -1;
+	}
+	if (n > loop->ready_size) {
+		loop->ready = realloc(loop->ready, sizeof(struct ros_loop_ready) * n);
+		if (loop->ready == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+		loop->ready_size = n;
+	}
+	for (i = 0; i < n; ++i) {
+		if (loop->events[i].data.ptr == loop) {
+			ros_loop_drain_wakeup(loop);
+			loop->ready[i].conn = NULL;
+			continue;
+		}
+		loop->ready[i].conn = loop->events[i].data.ptr;
+		loop->ready[i].readable = (loop->events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+		loop->ready[i].writable = (loop->events[i].events & EPOLLOUT) != 0;
+	}
+	loop->ready_count = n;
+#else
+	int count = 0;
+
+	for (i = 0; i < loop->count; ++i) {
+		loop->pfds[i].fd = loop->conns[i]->socket;
+		loop->pfds[i].events = POLLIN;
+		if (ros_pending_output(loop->conns[i]) > 0 || loop->conns[i]->connecting) {
+			loop->pfds[i].events |= POLLOUT;
+		}
+		loop->pfds[i].revents = 0;
+	}
+	loop->pfds[loop->count].fd = loop->wake[0];
+	loop->pfds[loop->count].events = POLLIN;
+	loop->pfds[loop->count].revents = 0;
+	do {
+		n = poll(loop->pfds, loop->count + 1, timeout);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		return -1;
+	}
+	if (loop->pfds[loop->count].revents != 0) {
+		ros_loop_drain_wakeup(loop);
+		n--;
+	}
+	for (i = 0; i < loop->count && count < n; ++i) {
+		if (loop->pfds[i].revents == 0) {
+			continue;
+		}
+		loop->ready[count].conn = loop->conns[i];
+		loop->ready[count].readable = (loop->pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+		loop->ready[count].writable = (loop->pfds[i].revents & POLLOUT) != 0;
+		count++;
+	}
+	loop->ready_count = count;
+#endif
+	return loop->ready_count;
+}
+
+/* Readiness engine, epoll or poll() */
+static int ros_loop_service(struct ros_loop *loop, int timeout) {
+	int i, total = 0;
+
+	if (ros_loop_wait(loop, timeout) < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < loop->ready_count; ++i) {
+		struct ros_connection *conn = loop->ready[i].conn;
+		int count = 0;
+
+		if (conn == NULL) {
+			continue;
+		}
+		if (conn->connecting) {
+			ros_loop_connect_done(loop, conn);
+			/* Failed, or removed by the connected handler */
+			if (loop->ready[i].conn == NULL) {
+				continue;
+			}
+		}
+		if (loop->ready[i].writable && ros_pending_output(conn) > 0 && ros_flush(conn) < 0) {
+			count = -1;
+		}
+		if (count >= 0 && loop->ready[i].readable) {
+			count = ros_runloop_drain(conn, conn->loop_callback);
+		}
+		if (count < 0) {
+			/* The connection may have been removed by one of its callbacks */
+			if (loop->ready[i].conn != NULL) {
+				ros_loop_closed(loop, conn);
+			}
+			continue;
+		}
+		total += count;
+	}
+	loop->ready_count = 0;
+	return total;
+}
+
+/* Waits up to timeout milliseconds (-1 for ever) and services every ready connection.
+   Returns the number of sentences dispatched, or -1 on error */
+int ros_loop_run_once(struct ros_loop *loop, int timeout) {
+	int total;
+
+	timeout = ros_loop_timeout(loop, timeout);
+#ifdef ROS_HAVE_URING
+	if (loop->uring != NULL) {
+		total = ros_uring_run(loop, timeout);
+	} else
+#endif
+	total = ros_loop_service(loop, timeout);
+
+	if (total >= 0) {
+		ros_loop_expire(loop);
+		ros_loop_start_dials(loop);
+	}
+	return total;
+}
+
+int ros_loop_count(struct ros_loop *loop) {
+	return loop->count;
+}
+
+/* Removes all connections from the loop and frees it, the connections are not closed */
+void ros_loop_free(struct ros_loop *loop) {
+	while (loop->count > 0) {
+		ros_loop_remove(loop, loop->conns[0]);
+	}
+#ifdef ROS_HAVE_URING
+	if (loop->uring != NULL) {
+		ros_uring_free(loop);
+	}
+#endif
+	close(loop->wake[0]);
+	close(loop->wake[1]);
+#ifdef __linux__
+	if (loop->epfd >= 0) {
+		close(loop->epfd);
+	}
+#else
+	free(loop->pfds);
+#endif
+	/* Dials that never started were never seen outside the loop */
+	while (loop->dial_count > 0) {
+		ros_disconnect(loop->dials[loop->dial_head].conn);
+		loop->dial_head = (loop->dial_head + 1) % loop->dial_size;
+		loop->dial_count--;
+	}
+	free(loop->dials);
+	free(loop->timed);
+	free(loop->ready);
+	free(loop->conns);
+	free(loop);
+}
+
+/* Starts a non-blocking connect to a numeric IPv4 or IPv6 address. Add the connection to a
+   loop to complete it, NULL if the address is invalid or the connect failed at once */
+struct ros_connection *ros_connect_async(char *address, int port) {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct ros_connection *conn;
+
+	if (!ros_parse_address(address, port, &addr, &addrlen)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	conn = ros_connection_new();
+	if ((errno = ros_connect_start(conn, &addr, addrlen)) != 0) {
+		free(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+/* connected is called with 0 or an errno value when a connect in the loop finishes, timeout
+   in milliseconds applies to connects added after this call, 0 leaves it to the kernel */
+void ros_loop_set_connect(struct ros_loop *loop, void (*connected)(struct ros_connection *conn, int error), int timeout) {
+	loop->connected = connected;
+	loop->connect_timeout = timeout;
+}
+
+/* Most connects in progress at once for ros_loop_dial(), 0 for no limit */
+void ros_loop_set_dial_limit(struct ros_loop *loop, int limit) {
+	loop->dial_limit = limit;
+	ros_loop_start_dials(loop);
+}
+
+/* Queues a connect, started by the loop when below the dial limit. The connection is handed to
+   the connected handler, with conn->userdata set, and is in the loop when that succeeded */
+int ros_loop_dial(struct ros_loop *loop, char *address, int port, void (*callback)(struct ros_result *result), void *userdata) {
+	struct ros_loop_dial *dial;
+
+	if (loop->dial_count == loop->dial_size) {
+		int i, size = loop->dial_size > 0 ? loop->dial_size * 2 : 64;
+		struct ros_loop_dial *dials = malloc(sizeof(struct ros_loop_dial) * size);
+
+		if (dials == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+		for (i = 0; i < loop->dial_count; ++i) {
+			dials[i] = loop->dials[(loop->dial_head + i) % loop->dial_size];
+		}
+		free(loop->dials);
+		loop->dials = dials;
+		loop->dial_size = size;
+		loop->dial_head = 0;
+	}
+
+	dial = &loop->dials[(loop->dial_head + loop->dial_count) % loop->dial_size];
+	if (!ros_parse_address(address, port, &dial->addr, &dial->addrlen)) {
+		return 0;
+	}
+	dial->conn = ros_connection_new();
+	dial->conn->userdata = userdata;
+	dial->callback = callback;
+	loop->dial_count++;
+
+	ros_loop_start_dials(loop);
+	return 1;
+}
+
+/* Connects in progress and dials waiting to start */
+int ros_loop_dialing(struct ros_loop *loop) {
+	return loop->connecting_count + loop->dial_count;
+}
+
+/* Multi-threaded runtime. Every thread runs its own loop, connections are sharded
+   across them by peer address and are only touched by their loop thread. Other
+   threads hand work over through a lock-free multi-producer queue per shard. */
+
+#define ROS_MSG_ADD 1
+#define ROS_MSG_SEND 2
+#define ROS_MSG_CLOSE 3
+
+struct ros_runtime_msg {
+	struct ros_runtime_msg *next;
+	int type;
+	struct ros_connection *conn;
+	void (*callback)(struct ros_result *result);
+	int num;
+	char **args;
+	int *len;
+};
+
+struct ros_runtime_shard {
+	struct ros_runtime *runtime;
+	struct ros_loop *loop;
+	pthread_t thread;
+	int index;
+	int stop;
+	int wake_pending;
+	/* Intrusive MPSC queue, producers swap head and the loop thread pops from tail */
+	struct ros_runtime_msg *head;
+	struct ros_runtime_msg *tail;
+	struct ros_runtime_msg stub;
+	/* Connections closed by the other end, freed by ros_runtime_close() */
+	struct ros_connection **dead;
+	int dead_count;
+	int dead_size;
+};
+
+struct ros_runtime {
+	struct ros_runtime_shard *shards;
+	int threads;
+	void (*disconnect)(struct ros_connection *conn);
+};
+
+static void ros_runtime_push(struct ros_runtime_shard *shard, struct ros_runtime_msg *msg) {
+	struct ros_runtime_msg *prev;
+
+	msg->next = NULL;
+	prev = __atomic_exchange_n(&shard->head, msg, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+/* Consumer side, returns NULL when empty or when a producer is half way through a push */
+static struct ros_runtime_msg *ros_runtime_pop(struct ros_runtime_shard *shard) {
+	struct ros_runtime_msg *tail = shard->tail;
+	struct ros_runtime_msg *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &shard->stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+		shard->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next != NULL) {
+		shard->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&shard->head, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	ros_runtime_push(shard, &shard->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		shard->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static void ros_runtime_send(struct ros_runtime_shard *shard, struct ros_runtime_msg *msg) {
+	ros_runtime_push(shard, msg);
+	/* One wakeup covers everything pushed until the loop thread starts draining */
+	if (__atomic_exchange_n(&shard->wake_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		ros_loop_wakeup(shard->loop);
+	}
+}
+
+static void ros_runtime_disconnected(struct ros_connection *conn) {
+	struct ros_runtime_shard *shard = conn->shard;
+
+	if (shard->dead_count == shard->dead_size) {
+		shard->dead_size = shard->dead_size > 0 ? shard->dead_size * 2 : 16;
+		shard->dead = realloc(shard->dead, sizeof(struct ros_connection *) * shard->dead_size);
+		if (shard->dead == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+	}
+	shard->dead[shard->dead_count++] = conn;
+	if (shard->runtime->disconnect != NULL) {
+		shard->runtime->disconnect(conn);
+	}
+}
+
+static void ros_runtime_handle(struct ros_runtime_shard *shard, struct ros_runtime_msg *msg) {
+	struct ros_connection *conn = msg->conn;
+	int i;
+
+	if (msg->type == ROS_MSG_ADD) {
+		if (!ros_loop_add(shard->loop, conn, msg->callback)) {
+			ros_runtime_disconnected(conn);
+		}
+	}
+	else if (msg->type == ROS_MSG_SEND && conn->loop != NULL) {
+		if (msg->callback != NULL) {
+			struct ros_event event;
+
+			event.tag = ros_next_tag(conn);
+			event.callback = msg->callback;
+			event.queue = NULL;
+			ros_add_event(conn, &event);
+			/* Room for the tag word was left after the data */
+			msg->args[msg->num] = (char *)(msg->len + msg->num + 1);
+			memcpy(msg->args[msg->num], ".tag=", 5);
+			msg->len[msg->num] = 5 + ros_format_tag(msg->args[msg->num] + 5, event.tag);
+			msg->num++;
+		}
+		ros_send_words(conn, msg->args, msg->len, msg->num);
+	}
+	else if (msg->type == ROS_MSG_CLOSE) {
+		for (i = 0; i < shard->dead_count; ++i) {
+			if (shard->dead[i] == conn) {
+				shard->dead[i] = shard->dead[--shard->dead_count];
+				break;
+			}
+		}
+		ros_disconnect(conn);
+	}
+	free(msg);
+}
+
+static void ros_runtime_drain(struct ros_runtime_shard *shard) {
+	struct ros_runtime_msg *msg;
+
+	__atomic_store_n(&shard->wake_pending, 0, __ATOMIC_RELEASE);
+	while ((msg = ros_runtime_pop(shard)) != NULL) {
+		ros_runtime_handle(shard, msg);
+	}
+}
+
+static void *ros_runtime_thread(void *arg) {
+	struct ros_runtime_shard *shard = arg;
+
+#ifdef __linux__
+	cpu_set_t cpus;
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cores > 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(shard->index % cores, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+#endif
+	while (!__atomic_load_n(&shard->stop, __ATOMIC_ACQUIRE)) {
+		ros_runtime_drain(shard);
+		if (ros_loop_run_once(shard->loop, -1) < 0) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Starts threads loops (cores when 0) using the given engine, NULL on failure */
+struct ros_runtime *ros_runtime_new(int threads, enum ros_engine engine) {
+	struct ros_runtime *runtime;
+	int i;
+
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads <= 0) {
+			threads = 1;
+		}
+	}
+	runtime = malloc(sizeof(struct ros_runtime));
+	if (runtime == NULL || (runtime->shards = malloc(sizeof(struct ros_runtime_shard) * threads)) == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	memset(runtime->shards, 0, sizeof(struct ros_runtime_shard) * threads);
+	runtime->threads = 0;
+	runtime->disconnect = NULL;
+
+	for (i = 0; i < threads; ++i) {
+		struct ros_runtime_shard *shard = &runtime->shards[i];
+
+		shard->runtime = runtime;
+		shard->index = i;
+		shard->head = shard->tail = &shard->stub;
+		shard->loop = ros_loop_new_engine(engine);
+		if (shard->loop == NULL) {
+			break;
+		}
+		ros_loop_set_disconnect(shard->loop, ros_runtime_disconnected);
+		if (pthread_create(&shard->thread, NULL, ros_runtime_thread, shard) != 0) {
+			ros_loop_free(shard->loop);
+			break;
+		}
+		runtime->threads++;
+	}
+	if (runtime->threads < threads) {
+		ros_runtime_free(runtime);
+		return NULL;
+	}
+	return runtime;
+}
+
+/* Called on the loop thread of the connection, before the connection is freed by ros_runtime_close() */
+void ros_runtime_set_disconnect(struct ros_runtime *runtime, void (*disconnect)(struct ros_connection *conn)) {
+	runtime->disconnect = disconnect;
+}
+
+int ros_runtime_threads(struct ros_runtime *runtime) {
+	return runtime->threads;
+}
+
+static struct ros_runtime_msg *ros_runtime_msg_new(int type, struct ros_connection *conn, int extra) {
+	struct ros_runtime_msg *msg = malloc(sizeof(struct ros_runtime_msg) + extra);
+
+	if (msg == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	msg->type = type;
+	msg->conn = conn;
+	msg->callback = NULL;
+	msg->num = 0;
+	msg->args = NULL;
+	msg->len = NULL;
+	return msg;
+}
+
+/* Hands a connection over to the runtime, the shard is picked from the peer address so
+   the same router always lands on the same thread. Callback works like in ros_loop_add() */
+int ros_runtime_add(struct ros_runtime *runtime, struct ros_connection *conn, void (*callback)(struct ros_result *result)) {
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	unsigned int hash = conn->socket;
+	struct ros_runtime_msg *msg;
+
+	if (conn->loop != NULL || conn->shard != NULL) {
+		return 0;
+	}
+	if (getpeername(conn->socket, (struct sockaddr *)&addr, &addrlen) == 0) {
+		if (addr.ss_family == AF_INET) {
+			struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+			hash = ntohl(in->sin_addr.s_addr) ^ (ntohs(in->sin_port) << 16);
+		} else if (addr.ss_family == AF_INET6) {
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+			hash = ros_hash_key((char *)&in6->sin6_addr, sizeof(in6->sin6_addr)) ^ (ntohs(in6->sin6_port) << 16);
+		}
+	}
+	hash = (hash * 2654435761u) >> 8;
+
+	conn->shard = &runtime->shards[hash % runtime->threads];
+	msg = ros_runtime_msg_new(ROS_MSG_ADD, conn, 0);
+	msg->callback = callback;
+	ros_runtime_send(conn->shard, msg);
+	return 1;
+}
+
+/* Queues a command from any thread. The words are copied, and callback (when not NULL)
+   is called on the loop thread for the replies like with ros_send_command_cb() */
+int ros_runtime_submit(struct ros_connection *conn, void (*callback)(struct ros_result *result), char **args, int num) {
+	struct ros_runtime_msg *msg;
+	int i, size = 0;
+	char *data;
+
+	if (conn->shard == NULL || num <= 0) {
+		return 0;
+	}
+	for (i = 0; i < num; ++i) {
+		size += strlen(args[i]);
+	}
+
+	/* Word pointers and lengths have a spare slot, and data room for a .tag word */
+	msg = ros_runtime_msg_new(ROS_MSG_SEND, conn, (sizeof(char *) + sizeof(int)) * (num + 1) + size + 16);
+	msg->callback = callback;
+	msg->num = num;
+	msg->args = (char **)(msg + 1);
+	msg->len = (int *)(msg->args + num + 1);
+	data = (char *)(msg->len + num + 1) + 16;
+	for (i = 0; i < num; ++i) {
+		msg->len[i] = strlen(args[i]);
+		msg->args[i] = data;
+		memcpy(data, args[i], msg->len[i]);
+		data += msg->len[i];
+	}
+	ros_runtime_send(conn->shard, msg);
+	return 1;
+}
+
+/* Closes and frees a connection added to the runtime, from any thread */
+int ros_runtime_close(struct ros_connection *conn) {
+	if (conn->shard == NULL) {
+		return 0;
+	}
+	ros_runtime_send(conn->shard, ros_runtime_msg_new(ROS_MSG_CLOSE, conn, 0));
+	return 1;
+}
+
+/* Stops the threads, and closes every connection still owned by the runtime */
+void ros_runtime_free(struct ros_runtime *runtime) {
+	int i;
+
+	for (i = 0; i < runtime->threads; ++i) {
+		__atomic_store_n(&runtime->shards[i].stop, 1, __ATOMIC_RELEASE);
+		ros_loop_wakeup(runtime->shards[i].loop);
+	}
+	for (i = 0; i < runtime->threads; ++i) {
+		struct ros_runtime_shard *shard = &runtime->shards[i];
+
+		pthread_join(shard->thread, NULL);
+		ros_runtime_drain(shard);
+		while (ros_loop_count(shard->loop) > 0) {
+			ros_disconnect(shard->loop->conns[0]);
+		}
+		while (shard->dead_count > 0) {
+			ros_disconnect(shard->dead[--shard->dead_count]);
+		}
+		free(shard->dead);
+		ros_loop_free(shard->loop);
+	}
+	free(runtime->shards);
+	free(runtime);
+}
+#endif
+
+struct ros_connection *ros_connect(char *address, int port) {
+	struct sockaddr_in s_address;
+	struct ros_connection *conn;
+
+#ifdef _WIN32
+	WSADATA wsaData;
+	int retval;
+#endif
+
+#ifdef _WIN32
+	if ((retval = WSAStartup(0x202, &wsaData)) != 0) {
+		fprintf(stderr,"Server: WSAStartup() failed with error %d\n", retval);
+		return NULL;
+	}
+#endif
+	conn = ros_connection_new();
+
+	conn->socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (conn->socket <= 0) {
+#ifdef _WIN32
+		WSACleanup();
+#endif
+		free(conn);
+		return NULL;
+	}
+
+	s_address.sin_family = AF_INET;
+	s_address.sin_addr.s_addr = inet_addr(address);
+	s_address.sin_port = htons(port);
+
+	if (
+		connect(conn->socket, (struct sockaddr *)&s_address, sizeof(s_address)) ==
+#ifdef _WIN32
+		SOCKET_ERROR
+#else
+		-1
+#endif
+	) {
+#ifdef _WIN32
+		closesocket(conn->socket);
+		WSACleanup();
+#else
+		close(conn->socket);
+#endif
+		free(conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+int ros_disconnect(struct ros_connection *conn) {
+#ifndef _WIN32
+	if (conn->loop != NULL) {
+		ros_loop_remove(conn->loop, conn);
+	}
+#endif
+	/* A login still in progress fails here at the latest, done can not disconnect again from it */
+	if (conn->closing) {
+		return 0;
+	}
+	conn->closing = 1;
+	/* From a callback, the connection is closed once dispatching is over */
+	if (conn->dispatch_depth > 0) {
+		return 0;
+	}
+	return ros_connection_close(conn);
+}
+
+static int ros_connection_close(struct ros_connection *conn) {
+	int result = 0;
+
+	if (conn->login != NULL) {
+		ros_login_finish(conn, conn->login->finished && conn->login->result > 0);
+	}
+#ifdef _WIN32
+	if (closesocket(conn->socket) == SOCKET_ERROR) {
+		result = -1;
+	}
+#else
+	result = close(conn->socket);
+#endif
+
+	while (conn->event_slabs != NULL) {
+		struct ros_event_slab *slab = conn->event_slabs;
+		conn->event_slabs = slab->next;
+		free(slab);
+	}
+	free(conn->event_table);
+	ros_set_arena(conn, 0);
+	ros_set_pool(conn, NULL);
+	ros_set_keys(conn, NULL);
+	free(conn->inbuf);
+	free(conn->outbuf);
+	free(conn->backlog);
+	free(conn);
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	return result;
+}
+
+void ros_result_free(struct ros_result *result) {
+	if (result == NULL) return;
+
+	switch (result->storage) {
+		case ROS_STORAGE_ARENA:
+			/* Released when the connection arena is reused */
+			return;
+		case ROS_STORAGE_BLOCK:
+			ros_sentence_release(result->sentence);
+			break;
+		case ROS_STORAGE_POOL:
+			ros_sentence_release(result->sentence);
+			result->sentence = NULL;
+			ros_pool_put(result);
+			return;
+		default:
+			ros_sentence_free(result->sentence);
+			break;
+	}
+	result->sentence = NULL;
+	free(result);
+}
+
+void ros_set_pool(struct ros_connection *conn, struct ros_pool *pool) {
+	if (pool != NULL) {
+		pool->refs++;
+	}
+	if (conn->pool != NULL) {
+		ros_pool_unref(conn->pool);
+	}
+	conn->pool = pool;
+}
+
+void ros_set_arena(struct ros_connection *conn, int size) {
+	if (conn->arena_result != NULL) {
+		ros_sentence_release(conn->arena_result->sentence);
+		conn->arena_result = NULL;
+	}
+	free(conn->arena.block);
+	conn->arena.block = NULL;
+	conn->arena.size = 0;
+	conn->arena.used = 0;
+
+	if (size > 0) {
+		conn->arena.block = malloc(size);
+		if (conn->arena.block == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+		conn->arena.size = size;
+	}
+}
+
+/* Length of the "=key=" a word lost to key interning, written to dst unless NULL */
+static int ros_word_prefix(struct ros_sentence *sentence, int i, char *dst) {
+	int id;
+
+	if (sentence->key == NULL || i >= sentence->data_words || (id = sentence->key[i]) < 0) {
+		return 0;
+	}
+	if (dst != NULL) {
+		dst[0] = '=';
+		memcpy(dst + 1, sentence->keys->name[id], sentence->keys->namelen[id]);
+		dst[sentence->keys->namelen[id] + 1] = '=';
+	}
+	return sentence->keys->namelen[id] + 2;
+}
+
+/* Copies a result into one heap block, so it no longer depends on the connection arena or pool */
+static struct ros_result *ros_result_copy(struct ros_result *src) {
+	struct ros_arena block;
+	struct ros_result *res;
+	struct ros_sentence *sentence;
+	int i, words = src->sentence->words, size = 0, index_size;
+	char *data;
+
+	for (i = 0; i < words; ++i) {
+		size += src->sentence->len[i] + 1 + ros_word_prefix(src->sentence, i, NULL);
+	}
+	for (index_size = 8; index_size < words * 2; index_size <<= 1);
+	block.size = ROS_ALIGN(sizeof(struct ros_result)) + ROS_ALIGN(sizeof(struct ros_sentence)) +
+		ROS_ALIGN(sizeof(char *) * words) + ROS_ALIGN(sizeof(int) * words) +
+		ROS_ALIGN(sizeof(unsigned short) * index_size) + ROS_ALIGN(size);
+	block.block = malloc(block.size);
+	if (block.block == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	block.used = 0;
+
+	res = ros_arena_alloc(&block, sizeof(struct ros_result));
+	sentence = ros_arena_alloc(&block, sizeof(struct ros_sentence));
+	*res = *src;
+	res->storage = ROS_STORAGE_BLOCK;
+	res->sentence = sentence;
+
+	memset(sentence, 0, sizeof(struct ros_sentence));
+	sentence->word = ros_arena_alloc(&block, sizeof(char *) * words);
+	sentence->len = ros_arena_alloc(&block, sizeof(int) * words);
+	sentence->index = ros_arena_alloc(&block, sizeof(unsigned short) * index_size);
+	sentence->data = ros_arena_alloc(&block, size);
+	sentence->words = words;
+	sentence->max_words = words;
+	sentence->data_words = words;
+	sentence->index_size = index_size;
+
+	/* Words with an interned key are spelled out again, the copy may go to another thread */
+	data = sentence->data;
+	for (i = 0; i < words; ++i) {
+		int prefix = ros_word_prefix(src->sentence, i, data);
+
+		memcpy(data + prefix, src->sentence->word[i], src->sentence->len[i] + 1);
+		sentence->word[i] = data;
+		sentence->len[i] = prefix + src->sentence->len[i];
+		data += sentence->len[i] + 1;
+	}
+	ros_result_free(src);
+	return res;
+}
+
+#ifndef _WIN32
+/* Bounded single-producer/single-consumer ring of results. The producer owns tail and the
+   consumer head; dropping the oldest result moves head too, so head is only advanced by CAS. */
+struct ros_queue {
+	struct ros_result **slots;
+	unsigned int capacity;
+	/* Slots are a power of two, so positions can wrap around */
+	unsigned int mask;
+	enum ros_queue_policy policy;
+	char pad1[64];
+	unsigned int head;
+	char pad2[64];
+	unsigned int tail;
+	char pad3[64];
+	unsigned long dropped;
+	/* Only used to sleep, when the ring is full or empty */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int producer_waiting;
+	int consumer_waiting;
+};
+
+struct ros_queue *ros_queue_new(int capacity, enum ros_queue_policy policy) {
+	struct ros_queue *queue;
+	int slots;
+
+	if (capacity <= 0) {
+		return NULL;
+	}
+	for (slots = 1; slots < capacity; slots <<= 1);
+	queue = malloc(sizeof(struct ros_queue));
+	if (queue == NULL || (queue->slots = malloc(sizeof(struct ros_result *) * slots)) == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	queue->capacity = capacity;
+	queue->mask = slots - 1;
+	queue->policy = policy;
+	queue->head = 0;
+	queue->tail = 0;
+	queue->dropped = 0;
+	queue->producer_waiting = 0;
+	queue->consumer_waiting = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->cond, NULL);
+	return queue;
+}
+
+static void ros_queue_wake(struct ros_queue *queue, int *waiting) {
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&queue->lock);
+		pthread_cond_broadcast(&queue->cond);
+		pthread_mutex_unlock(&queue->lock);
+	}
+}
+
+/* Sleeps until head or tail moves away from the given value, or timeout ms pass (-1 for ever) */
+static void ros_queue_wait(struct ros_queue *queue, int *waiting, unsigned int *pos, unsigned int value, int timeout) {
+	struct timespec ts;
+
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout / 1000;
+		ts.tv_nsec += (timeout % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+	pthread_mutex_lock(&queue->lock);
+	__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(pos, __ATOMIC_SEQ_CST) == value) {
+		if (timeout < 0) {
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		} else if (pthread_cond_timedwait(&queue->cond, &queue->lock, &ts) != 0) {
+			break;
+		}
+	}
+	__atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* Producer side. Returns 1 if the result was queued, 0 if it was dropped (and freed) */
+int ros_queue_push(struct ros_queue *queue, struct ros_result *result) {
+	unsigned int tail = queue->tail;
+
+	/* The consumer may free it on another thread, and must not touch the key table */
+	if (result->storage == ROS_STORAGE_ARENA || result->storage == ROS_STORAGE_POOL || result->sentence->key != NULL) {
+		result = ros_result_copy(result);
+	}
+
+	while (1) {
+		unsigned int head = __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST);
+
+		if (tail - head < queue->capacity) {
+			break;
+		}
+		if (queue->policy == ROS_QUEUE_DROP_NEWEST) {
+			ros_result_free(result);
+			__atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+		if (queue->policy == ROS_QUEUE_DROP_OLDEST) {
+			struct ros_result *oldest = queue->slots[head & queue->mask];
+			/* Loses to a consumer that took it first, which makes room anyway */
+			if (__atomic_compare_exchange_n(&queue->head, &head, head + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				ros_result_free(oldest);
+				__atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+			}
+			continue;
+		}
+		ros_queue_wait(queue, &queue->producer_waiting, &queue->head, head, -1);
+	}
+
+	queue->slots[tail & queue->mask] = result;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+	ros_queue_wake(queue, &queue->consumer_waiting);
+	return 1;
+}
+
+/* Consumer side. Takes up to max results, waiting up to timeout ms (-1 for ever) when empty.
+   Returns how many were stored in results, the caller frees them */
+int ros_queue_pop(struct ros_queue *queue, struct ros_result **results, int max, int timeout) {
+	while (1) {
+		unsigned int head = __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST);
+		unsigned int tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+		unsigned int i, count = tail - head;
+
+		if (count == 0) {
+			if (timeout == 0) {
+				return 0;
+			}
+			ros_queue_wait(queue, &queue->consumer_waiting, &queue->tail, tail, timeout);
+			/* Only one wait, then return whatever is there */
+			timeout = 0;
+			continue;
+		}
+		if (count > (unsigned int)max) {
+			count = max;
+		}
+		for (i = 0; i < count; ++i) {
+			results[i] = queue->slots[(head + i) & queue->mask];
+		}
+		if (__atomic_compare_exchange_n(&queue->head, &head, head + count, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			ros_queue_wake(queue, &queue->producer_waiting);
+			return count;
+		}
+	}
+}
+
+int ros_queue_length(struct ros_queue *queue) {
+	return __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+}
+
+unsigned long ros_queue_dropped(struct ros_queue *queue) {
+	return __atomic_load_n(&queue->dropped, __ATOMIC_RELAXED);
+}
+
+/* Frees the queue and any results left in it, neither side may use it any more */
+void ros_queue_free(struct ros_queue *queue) {
+	struct ros_result *result;
+
+	while (ros_queue_pop(queue, &result, 1, 0) > 0) {
+		ros_result_free(result);
+	}
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->cond);
+	free(queue->slots);
+	free(queue);
+}
+
+/* Every sentence received on the connection goes to the queue instead of the callbacks */
+void ros_set_queue(struct ros_connection *conn, struct ros_queue *queue) {
+	conn->queue = queue;
+}
+#endif
+
+int strcmp2(char *a, char *b) {
+	int i = 0;
+	while (1) {
+		if (a[i] == 0) {
+			return 1;
+		}
+		if (a[i] != b[i]) {
+			return 0;
+		}
+		i++;
+	}
+}
+
+char *ros_get_tag(struct ros_result *result) {
+	return ros_get_n(result, ".tag", 4);
+}
+
+static unsigned int ros_hash_key(const char *key, int keylen) {
+	unsigned int hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < keylen; ++i) {
+		hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/* Length of the key part of a word, "=name=value" has the key "=name". Returns 0 if there is none */
+static int ros_word_keylen(const char *word, int len) {
+	const char *eq;
+
+	if (len < 2) {
+		return 0;
+	}
+	eq = memchr(word + 1, '=', len - 1);
+	return eq != NULL ? eq - word : 0;
+}
+
+/* Builds the key lookup table of a sentence, if it is not up to date. Returns 0 if the sentence can not be indexed */
+static int ros_sentence_index(struct ros_sentence *sentence) {
+	unsigned int mask;
+	int i, size;
+
+	/* An empty sentence has no table, it is searched like one that can not be indexed */
+	if (sentence->words == 0 || sentence->words >= 0xffff) {
+		return 0;
+	}
+	if (sentence->index_words == sentence->words) {
+		return 1;
+	}
+
+	for (size = 8; size < sentence->words * 2; size <<= 1);
+	if (size > sentence->index_size) {
+		if (sentence->index_heap) {
+			free(sentence->index);
+		}
+		sentence->index = malloc(sizeof(unsigned short) * size);
+		if (sentence->index == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+		sentence->index_size = size;
+		sentence->index_heap = 1;
+	}
+	memset(sentence->index, 0, sizeof(unsigned short) * sentence->index_size);
+	mask = sentence->index_size - 1;
+
+	for (i = 0; i < sentence->words; ++i) {
+		int keylen = ros_word_keylen(sentence->word[i], sentence->len[i]);
+		unsigned int slot;
+
+		if (keylen == 0) {
+			continue;
+		}
+		slot = ros_hash_key(sentence->word[i], keylen) & mask;
+		while (sentence->index[slot] != 0) {
+			int other = sentence->index[slot] - 1;
+			/* The first occurrence of a key wins, like a linear search */
+			if (sentence->len[other] > keylen && sentence->word[other][keylen] == '=' && memcmp(sentence->word[other], sentence->word[i], keylen) == 0) {
+				break;
+			}
+			slot = (slot + 1) & mask;
+		}
+		if (sentence->index[slot] == 0) {
+			sentence->index[slot] = i + 1;
+		}
+	}
+	sentence->index_words = sentence->words;
+	return 1;
+}
+
+char *ros_get_n(struct ros_result *result, char *key, int keylen) {
+	struct ros_sentence *sentence;
+	unsigned int slot, mask;
+	char *inner;
+	int i;
+
+	if (result == NULL || keylen <= 0)
+		return NULL;
+	sentence = result->sentence;
+
+	/* Interned keys are compared by id. Words without a key id, like .tag, and words added later are still plain */
+	if (sentence->key != NULL) {
+		inner = keylen > 1 && key[0] == '=' ? memchr(key + 1, '=', keylen - 1) : NULL;
+		if (keylen > 1 && key[0] == '=' && inner == NULL && (i = ros_keys_find(sentence->keys, key + 1, keylen - 1)) >= 0) {
+			return ros_get_id(result, i);
+		}
+		for (i = 0; i < sentence->words; ++i) {
+			if (i < sentence->data_words && sentence->key[i] >= 0) {
+				/* A key with '=' in it reaches into the value, match it against the word as it was received */
+				int namelen = sentence->keys->namelen[sentence->key[i]], rest = keylen - namelen - 2;
+
+				if (inner == key + namelen + 1 && memcmp(key + 1, sentence->keys->name[sentence->key[i]], namelen) == 0 &&
+					sentence->len[i] > rest && sentence->word[i][rest] == '=' && memcmp(sentence->word[i], inner + 1, rest) == 0) {
+					return sentence->word[i] + rest + 1;
+				}
+				continue;
+			}
+			if (sentence->len[i] > keylen && sentence->word[i][keylen] == '=' && memcmp(sentence->word[i], key, keylen) == 0) {
+				return sentence->word[i] + keylen + 1;
+			}
+		}
+		return NULL;
+	}
+
+	/* Keys that contain '=' themselves are not in the index */
+	if (!ros_sentence_index(sentence) || memchr(key + 1, '=', keylen - 1) != NULL) {
+		for (i = 0; i < sentence->words; ++i) {
+			if (sentence->len[i] > keylen && sentence->word[i][keylen] == '=' && memcmp(sentence->word[i], key, keylen) == 0) {
+				return sentence->word[i] + keylen + 1;
+			}
+		}
+		return NULL;
+	}
+
+	mask = sentence->index_size - 1;
+	slot = ros_hash_key(key, keylen) & mask;
+	while (sentence->index[slot] != 0) {
+		i = sentence->index[slot] - 1;
+		if (sentence->len[i] > keylen && sentence->word[i][keylen] == '=' && memcmp(sentence->word[i], key, keylen) == 0) {
+			return sentence->word[i] + keylen + 1;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+/* Looks up a value by interned key id */
+char *ros_get_id(struct ros_result *result, int id) {
+	struct ros_sentence *sentence;
+	int i, namelen;
+	char *name;
+
+	if (result == NULL || result->sentence->key == NULL || id < 0 || id >= result->sentence->keys->count) {
+		return NULL;
+	}
+	sentence = result->sentence;
+	for (i = 0; i < sentence->data_words; ++i) {
+		if (sentence->key[i] == id) {
+			return sentence->word[i];
+		}
+	}
+
+	name = sentence->keys->name[id];
+	namelen = sentence->keys->namelen[id];
+	for (; i < sentence->words; ++i) {
+		if (sentence->len[i] > namelen + 1 && sentence->word[i][0] == '=' && sentence->word[i][namelen + 1] == '=' &&
+			memcmp(sentence->word[i] + 1, name, namelen) == 0) {
+			return sentence->word[i] + namelen + 2;
+		}
+	}
+	return NULL;
+}
+
+char *ros_get(struct ros_result *result, char *key) {
+	if (result == NULL)
+		return NULL;
+
+	return ros_get_n(result, key, strlen(key));
+}
+
+/* Loads 8 bytes as a little endian number, whatever the byte order of the host */
+static unsigned long long ros_load8(const char *s) {
+	const unsigned char *p = (const unsigned char *)s;
+
+	return (unsigned long long)p[0] | (unsigned long long)p[1] << 8 | (unsigned long long)p[2] << 16 |
+		(unsigned long long)p[3] << 24 | (unsigned long long)p[4] << 32 | (unsigned long long)p[5] << 40 |
+		(unsigned long long)p[6] << 48 | (unsigned long long)p[7] << 56;
+}
+
+/* Parses 8 digits at once, returns 0 if one of them is not a digit */
+static int ros_parse8(const char *s, unsigned long long *value) {
+	unsigned long long v = ros_load8(s);
+
+	if ((v & 0xf0f0f0f0f0f0f0f0ull) != 0x3030303030303030ull ||
+		((v + 0x0606060606060606ull) & 0xf0f0f0f0f0f0f0f0ull) != 0x3030303030303030ull) {
+		return 0;
+	}
+	v -= 0x3030303030303030ull;
+	v = v * 10 + (v >> 8);
+	*value = ((v & 0x000000ff000000ffull) * (100 + (1000000ull << 32)) +
+		((v >> 16) & 0x000000ff000000ffull) * (1 + (10000ull << 32))) >> 32;
+	return 1;
+}
+
+static int ros_parse_u64(const char *s, int len, unsigned long long *value) {
+	unsigned long long v = 0, chunk;
+	int i = 0;
+
+	if (len < 1 || len > 20) {
+		return 0;
+	}
+	if (len == 20) {
+		/* Only this long if close to the limit, so check every digit for overflow */
+		for (; i < len; ++i) {
+			unsigned int digit = (unsigned char)s[i] - '0';
+			if (digit > 9 || v > (0xffffffffffffffffull - digit) / 10) {
+				return 0;
+			}
+			v = v * 10 + digit;
+		}
+		*value = v;
+		return 1;
+	}
+	for (; len - i >= 8; i += 8) {
+		if (!ros_parse8(s + i, &chunk)) {
+			return 0;
+		}
+		v = v * 100000000 + chunk;
+	}
+	for (; i < len; ++i) {
+		unsigned int digit = (unsigned char)s[i] - '0';
+		if (digit > 9) {
+			return 0;
+		}
+		v = v * 10 + digit;
+	}
+	*value = v;
+	return 1;
+}
+
+static int ros_parse_i64(const char *s, int len, long long *value) {
+	unsigned long long v;
+	int neg = len > 0 && s[0] == '-';
+
+	if (!ros_parse_u64(s + neg, len - neg, &v) || v > 0x7fffffffffffffffull + neg) {
+		return 0;
+	}
+	*value = neg ? -(long long)(v - 1) - 1 : (long long)v;
+	return 1;
+}
+
+/* Reads digits with an optional fraction, the fraction is frac / scale with at most 9 digits kept */
+static int ros_parse_number(const char *s, int len, int *pos, unsigned long long *whole, unsigned long long *frac, unsigned long long *scale) {
+	int i = *pos, start = i;
+
+	*whole = 0;
+	*frac = 0;
+	*scale = 1;
+	for (; i < len && (unsigned int)(s[i] - '0') <= 9; ++i) {
+		unsigned int digit = s[i] - '0';
+		if (*whole > (0xffffffffffffffffull - digit) / 10) {
+			return 0;
+		}
+		*whole = *whole * 10 + digit;
+	}
+	if (i == start) {
+		return 0;
+	}
+	if (i < len && s[i] == '.') {
+		for (start = ++i; i < len && (unsigned int)(s[i] - '0') <= 9; ++i) {
+			if (i - start < 9) {
+				*frac = *frac * 10 + (s[i] - '0');
+				*scale *= 10;
+			}
+		}
+		if (i == start) {
+			return 0;
+		}
+	}
+	*pos = i;
+	return 1;
+}
+
+/* Returns frac / scale of unit, without overflowing for units that are multiples of powers of ten */
+static unsigned long long ros_scale_fraction(unsigned long long frac, unsigned long long scale, unsigned long long unit) {
+	while (scale > 1 && unit % 10 == 0) {
+		unit /= 10;
+		scale /= 10;
+	}
+	return frac * unit / scale;
+}
+
+/* Adds whole and frac / scale units to total, returns 0 if the sum would be over max */
+static int ros_add_scaled(unsigned long long *total, unsigned long long whole, unsigned long long frac, unsigned long long scale, unsigned long long unit, unsigned long long max) {
+	unsigned long long part, rest;
+
+	if (whole > max / unit) {
+		return 0;
+	}
+	part = whole * unit;
+	rest = ros_scale_fraction(frac, scale, unit);
+	if (rest > max - part || part + rest > max - *total) {
+		return 0;
+	}
+	*total += part + rest;
+	return 1;
+}
+
+static int ros_parse_double(const char *s, int len, double *value) {
+	static const double power[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+	unsigned long long mantissa = 0;
+	int i, neg = len > 0 && s[0] == '-', digits = 0, decimals = -1;
+	char buf[64], *end;
+	double v;
+
+	for (i = neg; i < len; ++i) {
+		unsigned int digit = (unsigned char)s[i] - '0';
+		if (digit <= 9) {
+			mantissa = mantissa * 10 + digit;
+			digits++;
+		} else if (s[i] == '.' && decimals < 0) {
+			decimals = i;
+		} else {
+			break;
+		}
+	}
+	decimals = decimals < 0 ? 0 : i - decimals - 1;
+
+	/* Exact when the digits fit in the mantissa of a double, anything else goes to strtod() */
+	if (i == len && digits > 0 && digits <= 15 && decimals <= 15) {
+		v = (double)mantissa / power[decimals];
+		*value = neg ? -v : v;
+		return 1;
+	}
+	if (len < 1 || len >= (int)sizeof(buf) || (s[0] != '-' && s[0] != '.' && (unsigned int)(s[0] - '0') > 9)) {
+		return 0;
+	}
+	/* strtod() also takes hex and nan or inf spellings, only plain decimals go through */
+	for (i = 0; i < len; ++i) {
+		if ((unsigned int)(s[i] - '0') > 9 && memchr("+-.eE", s[i], 5) == NULL) {
+			return 0;
+		}
+	}
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	v = strtod(buf, &end);
+	/* Also rejects nan and inf, and values out of range */
+	if (end != buf + len || v - v != 0) {
+		return 0;
+	}
+	*value = v;
+	return 1;
+}
+
+static int ros_parse_bool(const char *s, int len, int *value) {
+	if ((len == 4 && memcmp(s, "true", 4) == 0) || (len == 3 && memcmp(s, "yes", 3) == 0)) {
+		*value = 1;
+	} else if ((len == 5 && memcmp(s, "false", 5) == 0) || (len == 2 && memcmp(s, "no", 2) == 0)) {
+		*value = 0;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/* RouterOS durations, like "1w2d03:04:05", "1w2d3h4m5s", "150ms" or "00:00:01.5". A bare number is seconds */
+static int ros_parse_duration(const char *s, int len, long long *value) {
+	const unsigned long long second = 1000000000ull;
+	unsigned long long total = 0, whole, frac, scale, unit, minutes, seconds;
+	int i, neg = len > 0 && s[0] == '-';
+
+	if (len - neg < 1) {
+		return 0;
+	}
+	for (i = neg; i < len;) {
+		if (!ros_parse_number(s, len, &i, &whole, &frac, &scale)) {
+			return 0;
+		}
+		if (i == len) {
+			unit = second;
+		} else {
+			switch (s[i++]) {
+				case 'w':
+					unit = 604800 * second;
+					break;
+				case 'd':
+					unit = 86400 * second;
+					break;
+				case 'h':
+					unit = 3600 * second;
+					break;
+				case 'm':
+					if (i < len && s[i] == 's') {
+						i++;
+						unit = 1000000;
+					} else {
+						unit = 60 * second;
+					}
+					break;
+				case 's':
+					unit = second;
+					break;
+				case 'u':
+					if (i == len || s[i++] != 's') {
+						return 0;
+					}
+					unit = 1000;
+					break;
+				case 'n':
+					if (i == len || s[i++] != 's') {
+						return 0;
+					}
+					unit = 1;
+					break;
+				case ':':
+					/* hh:mm:ss, only the seconds can have a fraction and nothing may follow */
+					if (scale != 1 || !ros_parse_number(s, len, &i, &minutes, &frac, &scale) || scale != 1 ||
+						i == len || s[i++] != ':' || !ros_parse_number(s, len, &i, &seconds, &frac, &scale) || i != len ||
+						minutes >= 60 || seconds >= 60 || whole > 0x7fffffffffffffffull / (3600 * second)) {
+						return 0;
+					}
+					whole = whole * 3600 + minutes * 60 + seconds;
+					unit = second;
+					break;
+				default:
+					return 0;
+			}
+		}
+		if (!ros_add_scaled(&total, whole, frac, scale, unit, 0x7fffffffffffffffull)) {
+			return 0;
+		}
+	}
+	*value = neg ? -(long long)total : (long long)total;
+	return 1;
+}
+
+/* Rates like "10.5Mbps", "100k" or "1000", in bits per second */
+static int ros_parse_rate(const char *s, int len, unsigned long long *value) {
+	unsigned long long whole, frac, scale, unit = 1, total = 0;
+	int i = 0;
+
+	if (!ros_parse_number(s, len, &i, &whole, &frac, &scale)) {
+		return 0;
+	}
+	if (i < len) {
+		switch (s[i]) {
+			case 'k':
+			case 'K':
+				unit = 1000;
+				i++;
+				break;
+			case 'M':
+				unit = 1000000;
+				i++;
+				break;
+			case 'G':
+				unit = 1000000000;
+				i++;
+				break;
+			case 'T':
+				unit = 1000000000000ull;
+				i++;
+				break;
+		}
+	}
+	if (len - i == 3 && memcmp(s + i, "bps", 3) == 0) {
+		i += 3;
+	}
+	if (i != len) {
+		return 0;
+	}
+	if (!ros_add_scaled(&total, whole, frac, scale, unit, 0xffffffffffffffffull)) {
+		return 0;
+	}
+	*value = total;
+	return 1;
+}
+
+static int ros_parse_ip4(const char *s, int len, unsigned char *addr) {
+	int i = 0, part, digits, n;
+
+	for (part = 0; part < 4; ++part) {
+		if (part > 0 && (i == len || s[i++] != '.')) {
+			return 0;
+		}
+		for (n = 0, digits = 0; i < len && digits < 3 && (unsigned int)(s[i] - '0') <= 9; ++digits) {
+			n = n * 10 + (s[i++] - '0');
+		}
+		if (digits == 0 || n > 255) {
+			return 0;
+		}
+		addr[part] = n;
+	}
+	return i == len;
+}
+
+static int ros_parse_ip6(const char *s, int len, unsigned char *addr) {
+	unsigned char buf[16];
+	int i = 0, n = 0, gap = -1;
+
+	if (len >= 2 && s[0] == ':' && s[1] == ':') {
+		gap = 0;
+		i = 2;
+	}
+	while (i < len) {
+		int start = i, digits;
+		unsigned int group = 0;
+
+		for (digits = 0; i < len && digits < 4; ++digits, ++i) {
+			unsigned int c = (unsigned char)s[i];
+			if (c - '0' <= 9) {
+				group = group << 4 | (c - '0');
+			} else if ((c | 0x20) - 'a' < 6) {
+				group = group << 4 | ((c | 0x20) - 'a' + 10);
+			} else {
+				break;
+			}
+		}
+		/* An IPv4 address can take the last 32 bits */
+		if (i < len && s[i] == '.') {
+			if (n > 12 || !ros_parse_ip4(s + start, len - start, buf + n)) {
+				return 0;
+			}
+			n += 4;
+			break;
+		}
+		if (digits == 0 || n == 16) {
+			return 0;
+		}
+		buf[n++] = group >> 8;
+		buf[n++] = group;
+		if (i == len) {
+			break;
+		}
+		if (s[i++] != ':' || i == len) {
+			return 0;
+		}
+		if (s[i] == ':') {
+			if (gap >= 0) {
+				return 0;
+			}
+			gap = n;
+			i++;
+		}
+	}
+	if (gap < 0 ? n != 16 : n > 14) {
+		return 0;
+	}
+	if (gap >= 0) {
+		memset(addr, 0, 16);
+		memcpy(addr, buf, gap);
+		memcpy(addr + 16 - (n - gap), buf + gap, n - gap);
+	} else {
+		memcpy(addr, buf, 16);
+	}
+	return 1;
+}
+
+/* Addresses with an optional prefix length, like "192.168.88.1/24" or "2001:db8::1/64" */
+static int ros_parse_ip(const char *s, int len, struct ros_ip *ip) {
+	const char *slash = memchr(s, '/', len);
+	int addrlen = slash != NULL ? slash - s : len;
+	struct ros_ip parsed;
+	unsigned long long prefix;
+
+	memset(&parsed, 0, sizeof(parsed));
+	if (memchr(s, ':', addrlen) != NULL) {
+		parsed.family = 6;
+		if (!ros_parse_ip6(s, addrlen, parsed.addr)) {
+			return 0;
+		}
+	} else {
+		parsed.family = 4;
+		if (!ros_parse_ip4(s, addrlen, parsed.addr)) {
+			return 0;
+		}
+	}
+	parsed.prefix = parsed.family == 4 ? 32 : 128;
+	if (slash != NULL) {
+		if (len - addrlen - 1 > 3 || !ros_parse_u64(slash + 1, len - addrlen - 1, &prefix) || prefix > (unsigned long long)parsed.prefix) {
+			return 0;
+		}
+		parsed.prefix = prefix;
+	}
+	*ip = parsed;
+	return 1;
+}
+
+int ros_parse_value(enum ros_value_type type, char *value, int len, void *result) {
+	if (value == NULL || len < 0) {
+		return 0;
+	}
+	switch (type) {
+		case ROS_VALUE_STRING:
+			*(char **)result = value;
+			return 1;
+		case ROS_VALUE_U64:
+			return ros_parse_u64(value, len, result);
+		case ROS_VALUE_I64:
+			return ros_parse_i64(value, len, result);
+		case ROS_VALUE_DOUBLE:
+			return ros_parse_double(value, len, result);
+		case ROS_VALUE_BOOL:
+			return ros_parse_bool(value, len, result);
+		case ROS_VALUE_DURATION:
+			return ros_parse_duration(value, len, result);
+		case ROS_VALUE_RATE:
+			return ros_parse_rate(value, len, result);
+		case ROS_VALUE_IP:
+			return ros_parse_ip(value, len, result);
+	}
+	return 0;
+}
+
+static int ros_get_value(struct ros_result *result, char *key, enum ros_value_type type, void *value) {
+	char *str = ros_get(result, key);
+
+	return str != NULL && ros_parse_value(type, str, strlen(str), value);
+}
+
+int ros_get_u64(struct ros_result *result, char *key, unsigned long long *value) {
+	return ros_get_value(result, key, ROS_VALUE_U64, value);
+}
+
+int ros_get_i64(struct ros_result *result, char *key, long long *value) {
+	return ros_get_value(result, key, ROS_VALUE_I64, value);
+}
+
+int ros_get_double(struct ros_result *result, char *key, double *value) {
+	return ros_get_value(result, key, ROS_VALUE_DOUBLE, value);
+}
+
+int ros_get_bool(struct ros_result *result, char *key, int *value) {
+	return ros_get_value(result, key, ROS_VALUE_BOOL, value);
+}
+
+int ros_get_duration(struct ros_result *result, char *key, long long *ns) {
+	return ros_get_value(result, key, ROS_VALUE_DURATION, ns);
+}
+
+int ros_get_rate(struct ros_result *result, char *key, unsigned long long *bps) {
+	return ros_get_value(result, key, ROS_VALUE_RATE, bps);
+}
+
+int ros_get_ip(struct ros_result *result, char *key, struct ros_ip *ip) {
+	return ros_get_value(result, key, ROS_VALUE_IP, ip);
+}
+
+/* Decodes many attributes in one pass over the sentence. Returns how many fields were found and parsed */
+int ros_get_fields(struct ros_result *result, struct ros_field *fields, int count) {
+	struct ros_sentence *sentence;
+	int i, j, tries, next = 0, found = 0;
+
+	if (result == NULL) {
+		return 0;
+	}
+	sentence = result->sentence;
+	for (j = 0; j < count; ++j) {
+		fields[j].found = 0;
+	}
+
+	for (i = 0; i < sentence->words && found < count; ++i) {
+		char *name, *value;
+		int namelen, valuelen;
+
+		if (sentence->key != NULL && i < sentence->data_words) {
+			if (sentence->key[i] < 0) {
+				continue;
+			}
+			name = sentence->keys->name[sentence->key[i]];
+			namelen = sentence->keys->namelen[sentence->key[i]];
+			value = sentence->word[i];
+			valuelen = sentence->len[i];
+		} else {
+			int keylen = ros_word_keylen(sentence->word[i], sentence->len[i]);
+			if (keylen == 0 || sentence->word[i][0] != '=') {
+				continue;
+			}
+			name = sentence->word[i] + 1;
+			namelen = keylen - 1;
+			value = sentence->word[i] + keylen + 1;
+			valuelen = sentence->len[i] - keylen - 1;
+		}
+
+		/* Starts after the last match, so fields listed in the order of the reply match on the first try */
+		for (tries = 0, j = next; tries < count; ++tries, j = j + 1 == count ? 0 : j + 1) {
+			char *key = fields[j].key + (fields[j].key[0] == '=');
+			if (strncmp(key, name, namelen) == 0 && key[namelen] == '\0') {
+				break;
+			}
+		}
+		if (tries == count) {
+			continue;
+		}
+		next = j + 1 == count ? 0 : j + 1;
+		if (!fields[j].found && ros_parse_value(fields[j].type, value, valuelen, fields[j].value)) {
+			fields[j].found = 1;
+			found++;
+		}
+	}
+	return found;
+}
+
+/* Waits for a complete sentence in the receive buffer, returns its size or -1 on error/disconnect */
+static int inbuf_wait(struct ros_connection *conn, int *words) {
+	int size;
+
+	while ((size = inbuf_scan(conn, words)) == 0) {
+		int got = inbuf_fill(conn);
+		if (got == 0) {
+			return -1;
+		}
+		if (got < 0 && !wait_socket(conn, 0)) {
+			return -1;
+		}
+	}
+	return size;
+}
+
+struct ros_result *ros_read_packet(struct ros_connection *conn) {
+	int size, words;
+
+	if ((size = inbuf_wait(conn, &words)) < 0) {
+		return NULL;
+	}
+
+	return inbuf_sentence(conn, size, words);
+}
+
+/* Creates a sentence with room for the given number of words in the same allocation */
+struct ros_sentence *ros_sentence_new_n(int words) {
+	struct ros_sentence *res;
+
+	if (words < 1) {
+		words = 1;
+	}
+	res = malloc(ROS_ALIGN(sizeof(struct ros_sentence)) + ROS_ALIGN(sizeof(char *) * words) + sizeof(int) * words);
+	if (res == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	res->word = (char **)((char *)res + ROS_ALIGN(sizeof(struct ros_sentence)));
+	res->len = (int *)((char *)res->word + ROS_ALIGN(sizeof(char *) * words));
+	res->words = 0;
+	res->max_words = words;
+	res->arrays_heap = 0;
+	res->data = NULL;
+	res->data_words = 0;
+	res->index = NULL;
+	res->index_size = 0;
+	res->index_words = 0;
+	res->index_heap = 0;
+	res->key = NULL;
+	res->keys = NULL;
+	return res;
+}
+
+struct ros_sentence *ros_sentence_new() {
+	return ros_sentence_new_n(ROS_SENTENCE_WORDS);
+}
+
+void ros_sentence_free(struct ros_sentence *sentence) {
+	if (sentence == NULL) return;
+
+	ros_sentence_release(sentence);
+	free(sentence);
+}
+
+static void ros_sentence_grow(struct ros_sentence *sentence) {
+	char **word;
+	int *len;
+	int max;
+
+	if (sentence->words < sentence->max_words) {
+		return;
+	}
+
+	max = sentence->max_words * 2;
+	if (sentence->arrays_heap) {
+		word = realloc(sentence->word, sizeof(char *) * max);
+		len = realloc(sentence->len, sizeof(int) * max);
+	} else {
+		/* Arrays stored along with the sentence are moved out to the heap */
+		word = malloc(sizeof(char *) * max);
+		len = malloc(sizeof(int) * max);
+		if (word != NULL && len != NULL) {
+			memcpy(word, sentence->word, sizeof(char *) * sentence->words);
+			memcpy(len, sentence->len, sizeof(int) * sentence->words);
+		}
+	}
+	if (word == NULL || len == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	sentence->word = word;
+	sentence->len = len;
+	sentence->max_words = max;
+	sentence->arrays_heap = 1;
+}
+
+void ros_sentence_add(struct ros_sentence *sentence, char *word) {
+	ros_sentence_grow(sentence);
+
+	sentence->word[sentence->words] = strdup(word);
+	if (sentence->word[sentence->words] == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	sentence->len[sentence->words] = strlen(word);
+	sentence->words++;
+}
+
+static struct ros_sentence *ros_va_to_sentence(va_list ap, char *first, char *second) {
+	int i = 0;
+	struct ros_sentence *res = ros_sentence_new();
+
+	while (1) {
+		char *word;
+		if (i == 0) {
+			word = first;
+		}
+		else if (i == 1) {
+			if (second != NULL) {
+				word = second;
+			} else {
+				++i;
+				continue;
+			}
+		} else {
+			word = va_arg(ap, char *);
+			if (word == NULL) {
+				break;
+			}
+		}
+
+		ros_sentence_add(res, word);
+		++i;
+	}
+	return res;
+}
+
+
+/* Serializes words and an optional extra word into the output buffer, lengths are looked up with strlen()
+   when len is NULL. Returns the number of bytes added */
+static int ros_encode_words(struct ros_connection *conn, char **args, int *len, int num, char *extra) {
+	int i, wlen, count, total = 1;
+	unsigned char *dst;
+
+	/* Size the whole sentence first, so it is serialized in one go */
+	for (count = 0; count < num && args[count] != NULL; ++count) {
+		wlen = len != NULL ? len[count] : strlen(args[count]);
+		if (wlen == 0) {
+			break;
+		}
+		total += wlen + 5;
+	}
+	if (extra != NULL) {
+		total += strlen(extra) + 5;
+	}
+
+	outbuf_reserve(conn, total);
+	dst = conn->outbuf + conn->outbuf_len;
+	for (i = 0; i < count; ++i) {
+		wlen = len != NULL ? len[i] : strlen(args[i]);
+		dst += encode_length(dst, wlen);
+		memcpy(dst, args[i], wlen);
+		dst += wlen;
+		if (debug) {
+			printf("> %s\n", args[i]);
+		}
+	}
+	if (extra != NULL) {
+		wlen = strlen(extra);
+		dst += encode_length(dst, wlen);
+		memcpy(dst, extra, wlen);
+		dst += wlen;
+		if (debug) {
+			printf("> %s\n", extra);
+		}
+	}
+
+	/* Packet termination */
+	*dst++ = 0;
+	total = dst - (conn->outbuf + conn->outbuf_len);
+	conn->outbuf_len += total;
+	return total;
+}
+
+/* Serializes and sends words */
+static int ros_send_words(struct ros_connection *conn, char **args, int *len, int num) {
+	if (num == 0) return 0;
+
+	ros_encode_words(conn, args, len, num, NULL);
+	return ros_flush(conn) < 0 ? 0 : 1;
+}
+
+int ros_send_command_args(struct ros_connection *conn, char **args, int num) {
+	return ros_send_words(conn, args, NULL, num);
+}
+
+int ros_send_sentence(struct ros_connection *conn, struct ros_sentence *sentence) {
+	if (conn == NULL || sentence == NULL) {
+		return 0;
+	}
+
+	return ros_send_words(conn, sentence->word, sentence->len, sentence->words);
+}
+
+static int ros_send_command_va(struct ros_connection *conn, char *extra, char *command, va_list ap) {
+	struct ros_sentence *sentence;
+	int result;
+	
+	sentence = ros_va_to_sentence(ap, command, extra);
+	result = ros_send_sentence(conn, sentence);
+	ros_sentence_free(sentence);
+	return result;
+}
+
+#define ros_event_hash(tag, mask) (((unsigned int)(tag) * 2654435761u) & (mask))
+
+/* Returns the table index of the event with the given tag, or -1 */
+static int ros_find_event(struct ros_connection *conn, int tag) {
+	unsigned int mask, slot;
+
+	if (conn->event_count == 0) {
+		return -1;
+	}
+	mask = conn->event_table_size - 1;
+	slot = ros_event_hash(tag, mask);
+	while (conn->event_table[slot] != NULL) {
+		if (conn->event_table[slot]->tag == tag) {
+			return slot;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return -1;
+}
+
+static void ros_event_insert(struct ros_event **table, int size, struct ros_event *event) {
+	unsigned int mask = size - 1;
+	unsigned int slot = ros_event_hash(event->tag, mask);
+
+	while (table[slot] != NULL) {
+		slot = (slot + 1) & mask;
+	}
+	table[slot] = event;
+}
+
+static void ros_event_table_grow(struct ros_connection *conn) {
+	int i, size = conn->event_table_size > 0 ? conn->event_table_size * 2 : 16;
+	struct ros_event **table = malloc(sizeof(struct ros_event *) * size);
+
+	if (table == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	memset(table, 0, sizeof(struct ros_event *) * size);
+	for (i = 0; i < conn->event_table_size; ++i) {
+		if (conn->event_table[i] != NULL) {
+			ros_event_insert(table, size, conn->event_table[i]);
+		}
+	}
+	free(conn->event_table);
+	conn->event_table = table;
+	conn->event_table_size = size;
+}
+
+/* Event records are handed out from slabs, and recycled through a free-list */
+static struct ros_event *ros_event_alloc(struct ros_connection *conn) {
+	struct ros_event *event;
+
+	if (conn->free_events == NULL) {
+		struct ros_event_slab *slab = malloc(sizeof(struct ros_event_slab));
+		int i;
+
+		if (slab == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+		slab->next = conn->event_slabs;
+		conn->event_slabs = slab;
+		for (i = 0; i < ROS_EVENT_SLAB; ++i) {
+			slab->events[i].next = conn->free_events;
+			conn->free_events = &slab->events[i];
+		}
+	}
+	event = conn->free_events;
+	conn->free_events = event->next;
+	event->next = NULL;
+	return event;
+}
+
+/* Hands out tags in sequence, skipping any that are still waiting for a reply */
+static int ros_next_tag(struct ros_connection *conn) {
+	do {
+		if (conn->next_tag <= 0 || conn->next_tag == 0x7fffffff) {
+			conn->next_tag = 1;
+		}
+	} while (ros_find_event(conn, conn->next_tag++) >= 0);
+
+	return conn->next_tag - 1;
+}
+
+/* Returns the table entry for the tag, adding it if needed */
+static struct ros_event *ros_event_put(struct ros_connection *conn, int tag) {
+	struct ros_event *event;
+	int index = ros_find_event(conn, tag);
+
+	if (index >= 0) {
+		return conn->event_table[index];
+	}
+
+	if ((conn->event_count + 1) * 2 > conn->event_table_size) {
+		ros_event_table_grow(conn);
+	}
+	event = ros_event_alloc(conn);
+	event->tag = tag;
+	event->pipelined = 0;
+	event->sent = 0;
+	ros_event_insert(conn->event_table, conn->event_table_size, event);
+	conn->event_count++;
+	return event;
+}
+
+void ros_add_event(struct ros_connection *conn, struct ros_event *event) {
+	struct ros_event *entry = ros_event_put(conn, event->tag);
+
+	/* Re-using a tag replaces its callback */
+	entry->callback = event->callback;
+	entry->queue = event->queue;
+}
+
+static void ros_remove_event(struct ros_connection *conn, int index) {
+	unsigned int mask = conn->event_table_size - 1;
+	unsigned int hole = index, slot = index;
+	struct ros_event *event = conn->event_table[index];
+
+	event->next = conn->free_events;
+	conn->free_events = event;
+	conn->event_table[hole] = NULL;
+	conn->event_count--;
+
+	/* Shift back entries of the same probe run, so lookups need no tombstones */
+	while (1) {
+		unsigned int home;
+
+		slot = (slot + 1) & mask;
+		if (conn->event_table[slot] == NULL) {
+			break;
+		}
+		home = ros_event_hash(conn->event_table[slot]->tag, mask);
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			conn->event_table[hole] = conn->event_table[slot];
+			conn->event_table[slot] = NULL;
+			hole = slot;
+		}
+	}
+}
+
+/* NB! Blocking call, see ros_cancel_cb() */
+int ros_cancel(struct ros_connection *conn, int id) {
+	char iddata[16] = "=tag=";
+	int returnval;
+	struct ros_result *res;
+	int was_event = conn->type == ROS_EVENT;
+	
+	ros_format_tag(iddata + 5, id);
+	/* A request still in the backlog is ended without asking the router */
+	if (ros_pipeline_cancel(conn, id)) {
+		return 1;
+	}
+	if (was_event) {
+		ros_set_type(conn, ROS_SIMPLE);
+	}
+	res = ros_send_command_wait(conn, "/cancel", iddata, NULL);
+	if (was_event) {
+		ros_set_type(conn, ROS_EVENT);
+	}
+	if (res == NULL) {
+		return 0;
+	}
+	if (res->done) {
+		returnval = 1;
+	} else {
+		returnval = 0;
+	}
+	ros_result_free(res);
+	return returnval;
+}
 
-		if (len > 0) {
-			_read(conn->socket, buffer, len);
-			buffer[len] = '\0';
-			ros_sentence_add(ret->sentence, buffer);
-		}
-		free(buffer);
+static void ros_cancel_ignore(struct ros_result *result) {
+	ros_result_free(result);
+}
+
+/* Queues a tagged /cancel for each id without flushing, returns the tag of the last one */
+static int ros_cancel_encode(struct ros_connection *conn, int *ids, int count, void (*callback)(struct ros_result *result)) {
+	struct ros_event event;
+	char iddata[16] = "=tag=";
+	char extra[16] = ".tag=";
+	char *args[2];
+	int i;
 
-	} while (len > 0);
-	if (ret->sentence->words > 0) {
-		if (strcmp(ret->sentence->word[0], "!done") == 0) {
-			ret->done = 1;
+	args[0] = "/cancel";
+	args[1] = iddata;
+	event.callback = callback != NULL ? callback : ros_cancel_ignore;
+	event.queue = NULL;
+	for (i = 0; i < count; ++i) {
+		event.tag = ros_next_tag(conn);
+		ros_add_event(conn, &event);
+		/* The router never saw a request still in the backlog, so the /cancel is answered here */
+		if (ros_pipeline_cancel(conn, ids[i])) {
+			inbuf_route(conn, ros_result_local(conn, event.tag, "!done", NULL), NULL);
+			continue;
 		}
-		if (strcmp(ret->sentence->word[0], "!re") == 0) {
-			ret->re = 1;
+		ros_format_tag(iddata + 5, ids[i]);
+		ros_format_tag(extra + 5, event.tag);
+		ros_encode_words(conn, args, NULL, 2, extra);
+	}
+	return event.tag;
+}
+
+/* Non-blocking cancel, the reply to the /cancel goes to callback (or is dropped if NULL). Returns .tag id of the /cancel */
+int ros_cancel_cb(struct ros_connection *conn, int id, void (*callback)(struct ros_result *result)) {
+	int tag = ros_cancel_encode(conn, &id, 1, callback);
+
+	return ros_flush(conn) < 0 ? 0 : tag;
+}
+
+/* Cancels many tags with one write. Returns the number of /cancel requests sent, or 0 on error */
+int ros_cancel_many(struct ros_connection *conn, int *ids, int count, void (*callback)(struct ros_result *result)) {
+	if (count <= 0) {
+		return 0;
+	}
+	ros_cancel_encode(conn, ids, count, callback);
+	return ros_flush(conn) < 0 ? 0 : count;
+}
+
+/* Returns .tag id */
+int ros_send_command_cb(struct ros_connection *conn, void (*callback)(struct ros_result *result), char *command, ...) {
+	int result;
+	int id;
+	struct ros_event event;
+	char extra[16] = ".tag=";
+	va_list ap;
+
+	id = ros_next_tag(conn);
+	ros_format_tag(extra + 5, id);
+	event.tag = id;
+	event.callback = callback;
+	event.queue = NULL;
+
+	ros_add_event(conn, &event);
+
+	va_start(ap, command);
+	result = ros_send_command_va(conn, extra, command, ap);
+	va_end(ap);
+
+	return result > 0 ? id : 0;
+}
+
+int ros_send_sentence_cb(struct ros_connection *conn, void (*callback)(struct ros_result *result), struct ros_sentence *sentence) {
+	int result;
+	int id;
+	struct ros_event event;
+	char extra[16] = ".tag=";
+
+	id = ros_next_tag(conn);
+	ros_format_tag(extra + 5, id);
+	event.tag = id;
+	event.callback = callback;
+	event.queue = NULL;
+
+	ros_add_event(conn, &event);
+
+	ros_sentence_add(sentence, extra);
+	result = ros_send_sentence(conn, sentence);
+
+	return result > 0 ? id : 0;
+}
+
+static void backlog_reserve(struct ros_connection *conn, int needed) {
+	int size;
+
+	if (conn->backlog_len + needed <= conn->backlog_size) {
+		return;
+	}
+
+	/* Reclaim space already moved to the output buffer before growing */
+	if (conn->backlog_pos > 0) {
+		memmove(conn->backlog, conn->backlog + conn->backlog_pos, conn->backlog_len - conn->backlog_pos);
+		conn->backlog_len -= conn->backlog_pos;
+		conn->backlog_pos = 0;
+		if (conn->backlog_len + needed <= conn->backlog_size) {
+			return;
 		}
-		if (strcmp(ret->sentence->word[0], "!trap") == 0) {
-			ret->trap = 1;
+	}
+
+	size = conn->backlog_size > 0 ? conn->backlog_size : 1024;
+	while (size < conn->backlog_len + needed) {
+		size *= 2;
+	}
+	conn->backlog = realloc(conn->backlog, size);
+	if (conn->backlog == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	conn->backlog_size = size;
+}
+
+/* Moves waiting requests to the output buffer while the window has room, returns how many */
+static int ros_pipeline_release(struct ros_connection *conn) {
+	int len, tag, index, count = 0;
+	long long now = 0;
+
+	while (conn->backlog_count > 0 && (conn->window <= 0 || conn->inflight < conn->window)) {
+		/* Records are the encoded length, the tag and the encoded sentence */
+		memcpy(&len, conn->backlog + conn->backlog_pos, sizeof(int));
+		memcpy(&tag, conn->backlog + conn->backlog_pos + sizeof(int), sizeof(int));
+		outbuf_reserve(conn, len);
+		memcpy(conn->outbuf + conn->outbuf_len, conn->backlog + conn->backlog_pos + 2 * sizeof(int), len);
+		conn->outbuf_len += len;
+		conn->backlog_pos += 2 * sizeof(int) + len;
+		conn->backlog_count--;
+		if (conn->window_max > 0 && (index = ros_find_event(conn, tag)) >= 0) {
+			if (now == 0) {
+				now = ros_now_us();
+			}
+			conn->event_table[index]->sent = now;
 		}
-		if (strcmp(ret->sentence->word[0], "!fatal") == 0) {
-			ret->fatal = 1;
+		conn->inflight++;
+		count++;
+	}
+	if (conn->backlog_count == 0) {
+		conn->backlog_len = 0;
+		conn->backlog_pos = 0;
+	}
+	return count;
+}
+
+/* A reply made up for a request that was never sent */
+static struct ros_result *ros_result_local(struct ros_connection *conn, int tag, char *reply, char *message) {
+	struct ros_result *res = malloc(sizeof(struct ros_result));
+	char word[16] = ".tag=";
+
+	if (res == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	res->sentence = ros_sentence_new();
+	ros_sentence_add(res->sentence, reply);
+	if (message != NULL) {
+		ros_sentence_add(res->sentence, "=category=2");
+		ros_sentence_add(res->sentence, message);
+	}
+	ros_format_tag(word + 5, tag);
+	ros_sentence_add(res->sentence, word);
+	ros_result_set_reply(res, ros_classify_reply(reply, strlen(reply)));
+	res->storage = ROS_STORAGE_HEAP;
+	res->tag = tag;
+	res->conn = conn;
+	return res;
+}
+
+/* Takes a cancelled request out of the backlog before it is sent, and ends it like the
+   router would, with a !trap and a !done to its callback. Returns 1 if it was there */
+static int ros_pipeline_cancel(struct ros_connection *conn, int tag) {
+	int pos = conn->backlog_pos, len, other, size, index;
+
+	while (pos < conn->backlog_len) {
+		memcpy(&len, conn->backlog + pos, sizeof(int));
+		memcpy(&other, conn->backlog + pos + sizeof(int), sizeof(int));
+		size = 2 * sizeof(int) + len;
+		if (other == tag) {
+			break;
 		}
+		pos += size;
 	}
-	if (debug) {
-		int i;
-		for (i = 0; i < ret->sentence->words; ++i) {
-			printf("< %s\n", ret->sentence->word[i]);
+	if (pos >= conn->backlog_len) {
+		return 0;
+	}
+	memmove(conn->backlog + pos, conn->backlog + pos + size, conn->backlog_len - pos - size);
+	conn->backlog_len -= size;
+	if (--conn->backlog_count == 0) {
+		conn->backlog_len = 0;
+		conn->backlog_pos = 0;
+	}
+
+	/* It never counted against the window */
+	if ((index = ros_find_event(conn, tag)) >= 0) {
+		conn->event_table[index]->pipelined = 0;
+	}
+	inbuf_route(conn, ros_result_local(conn, tag, "!trap", "=message=interrupted"), NULL);
+	inbuf_route(conn, ros_result_local(conn, tag, "!done", NULL), NULL);
+	return 1;
+}
+
+/* Sends a batch of tagged requests back to back, at most window of them in flight. The rest wait,
+   already encoded, until earlier ones get their !done. Returns count, or 0 on error */
+int ros_send_batch(struct ros_connection *conn, void (*callback)(struct ros_result *result), struct ros_sentence **sentences, int count, int *ids) {
+	struct ros_event *event;
+	char extra[16] = ".tag=";
+	int i, len;
+
+	if (count <= 0) {
+		return 0;
+	}
+	for (i = 0; i < count; ++i) {
+		event = ros_event_put(conn, ros_next_tag(conn));
+		event->callback = callback;
+		event->queue = NULL;
+		event->pipelined = 1;
+		ros_format_tag(extra + 5, event->tag);
+		if (ids != NULL) {
+			ids[i] = event->tag;
+		}
+
+		len = ros_encode_words(conn, sentences[i]->word, sentences[i]->len, sentences[i]->words, extra);
+		if (conn->backlog_count == 0 && (conn->window <= 0 || conn->inflight < conn->window)) {
+			if (conn->window_max > 0) {
+				event->sent = ros_now_us();
+			}
+			conn->inflight++;
+			continue;
 		}
+
+		/* No room in the window, move the encoded sentence to the backlog */
+		backlog_reserve(conn, 2 * sizeof(int) + len);
+		memcpy(conn->backlog + conn->backlog_len, &len, sizeof(int));
+		memcpy(conn->backlog + conn->backlog_len + sizeof(int), &event->tag, sizeof(int));
+		memcpy(conn->backlog + conn->backlog_len + 2 * sizeof(int), conn->outbuf + conn->outbuf_len - len, len);
+		conn->backlog_len += 2 * sizeof(int) + len;
+		conn->backlog_count++;
+		conn->outbuf_len -= len;
 	}
 
-	return ret;
+	return ros_flush(conn) < 0 ? 0 : count;
 }
 
-struct ros_sentence *ros_sentence_new() {
-	struct ros_sentence *res = malloc(sizeof(struct ros_sentence));
-	res->words = 0;
-	res->word = malloc(sizeof(char *) * 100);
-	memset(res->word, 0, sizeof(char *) * 100);
-	if (res->word == NULL) {
+/* Limits pipelined requests in flight, 0 means no limit */
+void ros_set_window(struct ros_connection *conn, int window) {
+	conn->window = window;
+	conn->window_max = 0;
+	if (ros_pipeline_release(conn) > 0) {
+		ros_flush(conn);
+	}
+}
+
+/* Lets the window float between min and max, starting at min */
+void ros_set_adaptive_window(struct ros_connection *conn, int min, int max) {
+	if (min < 1) {
+		min = 1;
+	}
+	if (max < min) {
+		max = min;
+	}
+	conn->window_min = min;
+	conn->window_max = max;
+	conn->window_count = 0;
+	if (conn->window < min || conn->window > max) {
+		conn->window = min;
+	}
+	if (ros_pipeline_release(conn) > 0) {
+		ros_flush(conn);
+	}
+}
+
+int ros_pipeline_pending(struct ros_connection *conn) {
+	return conn->backlog_count;
+}
+
+#ifndef _WIN32
+/* Like ros_send_command_cb(), but the replies are pushed to queue. Returns .tag id */
+int ros_send_command_queue(struct ros_connection *conn, struct ros_queue *queue, char *command, ...) {
+	int result;
+	int id;
+	struct ros_event event;
+	char extra[16] = ".tag=";
+	va_list ap;
+
+	id = ros_next_tag(conn);
+	ros_format_tag(extra + 5, id);
+	event.tag = id;
+	event.callback = NULL;
+	event.queue = queue;
+
+	ros_add_event(conn, &event);
+
+	va_start(ap, command);
+	result = ros_send_command_va(conn, extra, command, ap);
+	va_end(ap);
+
+	return result > 0 ? id : 0;
+}
+
+int ros_send_sentence_queue(struct ros_connection *conn, struct ros_queue *queue, struct ros_sentence *sentence) {
+	int result;
+	int id;
+	struct ros_event event;
+	char extra[16] = ".tag=";
+
+	id = ros_next_tag(conn);
+	ros_format_tag(extra + 5, id);
+	event.tag = id;
+	event.callback = NULL;
+	event.queue = queue;
+
+	ros_add_event(conn, &event);
+
+	ros_sentence_add(sentence, extra);
+	result = ros_send_sentence(conn, sentence);
+
+	return result > 0 ? id : 0;
+}
+#endif
+
+
+int ros_send_command(struct ros_connection *conn, char *command, ...) {
+	int result;
+	va_list ap;
+	va_start(ap, command);
+	result = ros_send_command_va(conn, NULL, command, ap);
+	va_end(ap);
+	return result;
+}
+
+struct ros_result *ros_send_command_wait(struct ros_connection *conn, char *command, ...) {
+	int result;
+
+	va_list ap;
+	va_start(ap, command);
+	result = ros_send_command_va(conn, NULL, command, ap);
+	va_end(ap);
+
+	if (result == 0) {
+		return NULL;
+	}
+	/* Read packet */
+	return ros_read_packet(conn);
+}
+
+static struct ros_cursor *ros_cursor_new(struct ros_connection *conn) {
+	struct ros_cursor *cursor = malloc(sizeof(struct ros_cursor));
+
+	if (cursor == NULL) {
 		fprintf(stderr, "Error allocating memory\n");
 		exit(1);
 	}
-	return res;
+	cursor->conn = conn;
+	cursor->tag = -1;
+	cursor->reply = ROS_REPLY_UNKNOWN;
+	cursor->field = NULL;
+	cursor->fields = 0;
+	cursor->max_fields = 0;
+	cursor->finished = 0;
+	cursor->message = NULL;
+	return cursor;
 }
 
-void ros_sentence_free(struct ros_sentence *sentence) {
-	int i;
-	if (sentence == NULL) return;
+/* Sends the sentence with a tag of its own, its rows are then read with ros_cursor_next() */
+struct ros_cursor *ros_cursor_open_sentence(struct ros_connection *conn, struct ros_sentence *sentence) {
+	struct ros_cursor *cursor;
+	struct ros_event *event;
+	char extra[16] = ".tag=";
 
-	for (i = 0; i < sentence->words; ++i) {
-		free(sentence->word[i]);
-		sentence->word[i] = NULL;
+	if (conn == NULL || sentence == NULL || sentence->words == 0) {
+		return NULL;
 	}
-	free(sentence->word);
-	sentence->word = NULL;
-	free(sentence);
+
+	/* Keeps the tag taken. Rows still arriving after an early close are dropped by the event */
+	cursor = ros_cursor_new(conn);
+	event = ros_event_put(conn, ros_next_tag(conn));
+	event->callback = ros_cancel_ignore;
+	event->queue = NULL;
+	cursor->tag = event->tag;
+	ros_format_tag(extra + 5, cursor->tag);
+
+	ros_encode_words(conn, sentence->word, sentence->len, sentence->words, extra);
+	if (ros_flush(conn) < 0) {
+		ros_cursor_close(cursor);
+		return NULL;
+	}
+	return cursor;
 }
 
-void ros_sentence_add(struct ros_sentence *sentence, char *word) {
-	if ((sentence->words+1) / 100 > sentence->words / 100) {
-		sentence->word = realloc(sentence->word, sizeof(char *) * ((((sentence->words+1)/100) + 1)*100));
-		if (sentence->word == NULL) {
+struct ros_cursor *ros_cursor_open(struct ros_connection *conn, char *command, ...) {
+	struct ros_sentence *sentence;
+	struct ros_cursor *cursor;
+	va_list ap;
+
+	va_start(ap, command);
+	sentence = ros_va_to_sentence(ap, command, NULL);
+	va_end(ap);
+	cursor = ros_cursor_open_sentence(conn, sentence);
+	ros_sentence_free(sentence);
+	return cursor;
+}
+
+/* Splits the sentence at the start of the receive buffer into fields, without copying.
+   Returns its tag, the words are only terminated in place once it is known to be ours */
+static int ros_cursor_parse(struct ros_cursor *cursor, int words) {
+	struct ros_connection *conn = cursor->conn;
+	unsigned char *pos = conn->inbuf + conn->inbuf_start;
+	unsigned int len;
+	int i, tag = -1;
+
+	cursor->fields = 0;
+	cursor->reply = ROS_REPLY_UNKNOWN;
+	if (words > cursor->max_fields) {
+		cursor->max_fields = words;
+		cursor->field = realloc(cursor->field, sizeof(struct ros_cursor_field) * words);
+		if (cursor->field == NULL) {
 			fprintf(stderr, "Error allocating memory\n");
 			exit(1);
 		}
 	}
+	for (i = 0; i < words; ++i) {
+		char *word;
 
-	sentence->word[sentence->words] = strdup(word);
-	if (sentence->word[sentence->words] == NULL) {
+		pos += decode_length(pos, 5, &len);
+		word = (char *)pos;
+		pos += len;
+		if (i == 0) {
+			cursor->reply = ros_classify_reply(word, len);
+		} else if (len > 5 && memcmp(word, ".tag=", 5) == 0) {
+			if (!ros_parse_tag(word + 5, len - 5, &tag)) {
+				tag = -1;
+			}
+		} else if (len > 1 && word[0] == '=') {
+			struct ros_cursor_field *field = &cursor->field[cursor->fields++];
+			char *sep = memchr(word + 1, '=', len - 1);
+
+			field->key = word + 1;
+			field->keylen = sep != NULL ? sep - word - 1 : len - 1;
+			field->value = sep != NULL ? sep + 1 : word + len;
+			field->valuelen = sep != NULL ? word + len - sep - 1 : 0;
+		}
+	}
+	return tag;
+}
+
+/* Reads up to the next row. Other replies on the connection go to their callbacks, and sentences of
+   this cursor are consumed in place, so the fields are only valid until the next call. Returns 1 for
+   a row, 0 once the command is done (cursor->message is set if it failed) */
+int ros_cursor_next(struct ros_cursor *cursor) {
+	struct ros_connection *conn = cursor->conn;
+	int size, words, i;
+
+	while (!cursor->finished) {
+		if ((size = inbuf_wait(conn, &words)) < 0) {
+			cursor->reply = ROS_REPLY_FATAL;
+			cursor->fields = 0;
+			cursor->finished = 1;
+			break;
+		}
+		if (ros_cursor_parse(cursor, words) != cursor->tag && cursor->reply != ROS_REPLY_FATAL) {
+			inbuf_route(conn, inbuf_sentence(conn, size, words), NULL);
+			continue;
+		}
+
+		/* Ours: terminate keys and values where the separators and length prefixes were */
+		for (i = 0; i < cursor->fields; ++i) {
+			cursor->field[i].key[cursor->field[i].keylen] = '\0';
+			cursor->field[i].value[cursor->field[i].valuelen] = '\0';
+		}
+		conn->inbuf_start += size;
+
+		if (cursor->reply == ROS_REPLY_RE) {
+			return 1;
+		}
+		if (cursor->reply == ROS_REPLY_TRAP || cursor->reply == ROS_REPLY_FATAL) {
+			char *message = ros_cursor_get(cursor, "message");
+			if (cursor->message == NULL) {
+				cursor->message = strdup(message != NULL ? message : "unknown error");
+			}
+		}
+		if (cursor->reply == ROS_REPLY_DONE || cursor->reply == ROS_REPLY_FATAL) {
+			int index = ros_find_event(conn, cursor->tag);
+			if (index >= 0) {
+				ros_remove_event(conn, index);
+			}
+			cursor->finished = 1;
+		}
+	}
+	return 0;
+}
+
+/* Value of a field in the current row, or NULL */
+char *ros_cursor_get(struct ros_cursor *cursor, char *key) {
+	int i, keylen = strlen(key);
+
+	for (i = 0; i < cursor->fields; ++i) {
+		if (cursor->field[i].keylen == keylen && memcmp(cursor->field[i].key, key, keylen) == 0) {
+			return cursor->field[i].value;
+		}
+	}
+	return NULL;
+}
+
+/* Cancels the command if it is still running, and skips the rest of its rows and the reply to the cancel */
+void ros_cursor_close(struct ros_cursor *cursor) {
+	struct ros_connection *conn = cursor->conn;
+	int cancel, size, words;
+
+	if (!cursor->finished && (cancel = ros_cancel_cb(conn, cursor->tag, NULL)) > 0) {
+		while (ros_cursor_next(cursor));
+		while (ros_find_event(conn, cancel) >= 0 && (size = inbuf_wait(conn, &words)) > 0) {
+			inbuf_route(conn, inbuf_sentence(conn, size, words), NULL);
+		}
+	}
+	free(cursor->field);
+	free(cursor->message);
+	free(cursor);
+}
+
+struct ros_table *ros_table_new() {
+	struct ros_table *table = malloc(sizeof(struct ros_table));
+
+	if (table == NULL) {
 		fprintf(stderr, "Error allocating memory\n");
 		exit(1);
 	}
-	sentence->words++;
+	table->column = NULL;
+	table->columns = 0;
+	table->max_columns = 0;
+	table->rows = 0;
+	table->max_rows = 0;
+	table->index = NULL;
+	table->index_size = 0;
+	return table;
 }
 
-static struct ros_sentence *ros_va_to_sentence(va_list ap, char *first, char *second) {
-	int i = 0;
-	struct ros_sentence *res = ros_sentence_new();
+static void ros_table_rehash(struct ros_table *table) {
+	int i;
 
-	while (1) {
-		char *word;
-		if (i == 0) {
-			word = first;
+	table->index_size = table->index_size > 0 ? table->index_size * 2 : 32;
+	free(table->index);
+	table->index = malloc(sizeof(int) * table->index_size);
+	if (table->index == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	for (i = 0; i < table->index_size; ++i) {
+		table->index[i] = -1;
+	}
+	for (i = 0; i < table->columns; ++i) {
+		unsigned int slot = ros_hash_key(table->column[i].name, table->column[i].namelen);
+		while (table->index[slot & (table->index_size - 1)] >= 0) {
+			slot++;
 		}
-		else if (i == 1) {
-			if (second != NULL) {
-				word = second;
-			} else {
-				++i;
-				continue;
-			}
-		} else {
-			word = va_arg(ap, char *);
-			if (word == NULL) {
-				break;
+		table->index[slot & (table->index_size - 1)] = i;
+	}
+}
+
+/* Returns the column for a name, adding it when create is set. Rows before it are missing */
+static int ros_table_lookup(struct ros_table *table, const char *name, int namelen, int create) {
+	struct ros_column *column;
+	unsigned int slot;
+
+	if (table->index_size > 0) {
+		slot = ros_hash_key(name, namelen);
+		while (table->index[slot & (table->index_size - 1)] >= 0) {
+			column = &table->column[table->index[slot & (table->index_size - 1)]];
+			if (column->namelen == namelen && memcmp(column->name, name, namelen) == 0) {
+				return table->index[slot & (table->index_size - 1)];
 			}
+			slot++;
+		}
+	}
+	if (!create) {
+		return -1;
+	}
+
+	if (table->columns == table->max_columns) {
+		table->max_columns = table->max_columns > 0 ? table->max_columns * 2 : 16;
+		table->column = realloc(table->column, sizeof(struct ros_column) * table->max_columns);
+		if (table->column == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
 		}
+	}
+	column = &table->column[table->columns];
+	column->name = malloc(namelen + 1);
+	column->offset = calloc(table->max_rows + 1, sizeof(int));
+	column->valid = calloc((table->max_rows + 7) / 8 + 1, 1);
+	if (column->name == NULL || column->offset == NULL || column->valid == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	memcpy(column->name, name, namelen);
+	column->name[namelen] = '\0';
+	column->namelen = namelen;
+	column->data = NULL;
+	column->data_len = 0;
+	column->data_size = 0;
+	table->columns++;
 
-		ros_sentence_add(res, word);
-		++i;
+	/* Keeps the index at most half full */
+	if (table->columns * 2 > table->index_size) {
+		ros_table_rehash(table);
+	} else {
+		slot = ros_hash_key(name, namelen);
+		while (table->index[slot & (table->index_size - 1)] >= 0) {
+			slot++;
+		}
+		table->index[slot & (table->index_size - 1)] = table->columns - 1;
 	}
-	return res;
+	return table->columns - 1;
 }
 
+/* Makes room for one more row in every column */
+static void ros_table_grow(struct ros_table *table) {
+	int i, old = table->max_rows;
 
-int ros_send_command_args(struct ros_connection *conn, char **args, int num) {
-	int i = 0, len = 0;
-	char *arg;
-	if (num == 0) return 0;
+	if (table->rows < table->max_rows) {
+		return;
+	}
+	table->max_rows = old > 0 ? old * 2 : 256;
+	for (i = 0; i < table->columns; ++i) {
+		struct ros_column *column = &table->column[i];
 
-	arg = args[i];
-	while (arg != 0 && (len = strlen(arg)) != 0) {
-		if (send_length(conn, len) == 0) {
-			return 0;
+		column->offset = realloc(column->offset, sizeof(int) * (table->max_rows + 1));
+		column->valid = realloc(column->valid, (table->max_rows + 7) / 8 + 1);
+		if (column->offset == NULL || column->valid == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
 		}
-		if (_write(conn->socket, arg, len) != len) {
-			return 0;
+		memset(column->valid + (old + 7) / 8 + 1, 0, (table->max_rows + 7) / 8 - (old + 7) / 8);
+	}
+}
+
+/* Appends a value to the row being built, the first of repeated keys wins */
+static void ros_table_set(struct ros_table *table, const char *key, int keylen, const char *value, int valuelen) {
+	int index = ros_table_lookup(table, key, keylen, 1);
+	struct ros_column *column = &table->column[index];
+	int row = table->rows;
+
+	if (column->valid[row / 8] & (1 << (row % 8))) {
+		return;
+	}
+	if (column->data_len + valuelen + 1 > column->data_size) {
+		column->data_size = column->data_size > 0 ? column->data_size : 1024;
+		while (column->data_len + valuelen + 1 > column->data_size) {
+			column->data_size *= 2;
 		}
-		if (debug) {
-			printf("> %s\n", arg);
+		column->data = realloc(column->data, column->data_size);
+		if (column->data == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
 		}
-		arg = args[++i];
 	}
+	memcpy(column->data + column->data_len, value, valuelen);
+	column->data[column->data_len + valuelen] = '\0';
+	column->data_len += valuelen + 1;
+	column->offset[row + 1] = column->data_len;
+	column->valid[row / 8] |= 1 << (row % 8);
+}
 
-	/* Packet termination */
-	if (send_length(conn, 0) == 0) {
-	  return 0;
-	}
+/* Closes the row, columns it did not have get an empty, missing value */
+static void ros_table_end_row(struct ros_table *table) {
+	int i, row = table->rows;
 
-	return 1;
+	for (i = 0; i < table->columns; ++i) {
+		struct ros_column *column = &table->column[i];
+		if (!(column->valid[row / 8] & (1 << (row % 8)))) {
+			column->offset[row + 1] = column->offset[row];
+		}
+	}
+	table->rows++;
 }
 
-int ros_send_sentence(struct ros_connection *conn, struct ros_sentence *sentence) {
-	if (conn == NULL || sentence == NULL) {
+/* Adds a !re result as a row, returns 1 if it was one */
+int ros_table_add(struct ros_table *table, struct ros_result *result) {
+	struct ros_sentence *sentence = result->sentence;
+	int i;
+
+	if (!result->re) {
 		return 0;
 	}
+	ros_table_grow(table);
+	for (i = 1; i < sentence->words; ++i) {
+		int keylen;
 
-	return ros_send_command_args(conn, sentence->word, sentence->words);
+		if (sentence->key != NULL && i < sentence->data_words && sentence->key[i] >= 0) {
+			ros_table_set(table, sentence->keys->name[sentence->key[i]], sentence->keys->namelen[sentence->key[i]],
+				sentence->word[i], sentence->len[i]);
+			continue;
+		}
+		keylen = ros_word_keylen(sentence->word[i], sentence->len[i]);
+		if (keylen > 0 && sentence->word[i][0] == '=') {
+			ros_table_set(table, sentence->word[i] + 1, keylen - 1,
+				sentence->word[i] + keylen + 1, sentence->len[i] - keylen - 1);
+		}
+	}
+	ros_table_end_row(table);
+	return 1;
 }
 
-static int ros_send_command_va(struct ros_connection *conn, char *extra, char *command, va_list ap) {
-	struct ros_sentence *sentence;
-	int result;
-	
-	sentence = ros_va_to_sentence(ap, command, extra);
-	result = ros_send_sentence(conn, sentence);
-	ros_sentence_free(sentence);
-	return result;
-}
+/* Adds the current row of a cursor */
+int ros_table_add_cursor(struct ros_table *table, struct ros_cursor *cursor) {
+	int i;
 
-void ros_add_event(struct ros_connection *conn, struct ros_event *event) {
-	int idx = 0;
-	char isnew = 0;
-
-	if (conn->events == NULL) {
-		conn->max_events = 1;
-		conn->events = malloc(sizeof(struct ros_event **));
-		idx = 0;
-		isnew = 1;
-	} else {
-		int i;
-		idx = -1;
-		for (i = 0; i < conn->max_events; ++i) {
-			if (conn->events[i]->inuse == 0) {
-				idx = i;
-				break;
-			}
-		}
-		if (idx == -1) {
-			isnew = 1;
-			idx = conn->max_events++;
-			conn->events = realloc(conn->events, sizeof(struct ros_event **) * conn->max_events);
-			if (conn->events == NULL) {
-				fprintf(stderr, "Error allocating memory\n");
-				exit(1);
-			}
-		}
+	if (cursor->reply != ROS_REPLY_RE) {
+		return 0;
 	}
-	if (isnew) {
-		conn->events[idx] = malloc(sizeof(struct ros_event));
-		if (conn->events[idx] == NULL) {
-			fprintf(stderr, "Error allocating memory\n");
-		}
+	ros_table_grow(table);
+	for (i = 0; i < cursor->fields; ++i) {
+		ros_table_set(table, cursor->field[i].key, cursor->field[i].keylen,
+			cursor->field[i].value, cursor->field[i].valuelen);
 	}
-	memcpy(conn->events[idx], event, sizeof(struct ros_event));
-	conn->events[idx]->inuse = 1;
+	ros_table_end_row(table);
+	return 1;
 }
 
-static void ros_remove_event(struct ros_connection *conn, int index) {
-	if (index < conn->max_events) {
-		conn->events[index]->inuse = 0;
-	}
+int ros_table_column(struct ros_table *table, char *name) {
+	return ros_table_lookup(table, name, strlen(name), 0);
 }
 
-/* NB! Blocking call. TODO: Fix */
-int ros_cancel(struct ros_connection *conn, int id) {
-	char iddata[1024];
-	int returnval;
-	struct ros_result *res;
-	int was_event = conn->type == ROS_EVENT;
-	
-	snprintf(iddata, 1024, "=tag=%d", id);
-	if (was_event) {
-		ros_set_type(conn, ROS_SIMPLE);
-	}
-	res = ros_send_command_wait(conn, "/cancel", iddata, NULL);
-	if (was_event) {
-		ros_set_type(conn, ROS_EVENT);
+/* Value of a column in a row, NULL if the row did not have it */
+char *ros_table_get(struct ros_table *table, int column, int row) {
+	struct ros_column *col;
+
+	if (column < 0 || column >= table->columns || row < 0 || row >= table->rows) {
+		return NULL;
 	}
-	if (res == NULL) {
-		return 0;
+	col = &table->column[column];
+	if (!(col->valid[row / 8] & (1 << (row % 8)))) {
+		return NULL;
 	}
-	if (res->done) {
-		returnval = 1;
-	} else {
-		returnval = 0;
+	return col->data + col->offset[row];
+}
+
+void ros_table_free(struct ros_table *table) {
+	int i;
+
+	for (i = 0; i < table->columns; ++i) {
+		free(table->column[i].name);
+		free(table->column[i].data);
+		free(table->column[i].offset);
+		free(table->column[i].valid);
 	}
-	ros_result_free(res);
-	return returnval;
+	free(table->column);
+	free(table->index);
+	free(table);
 }
 
-/* Returns .tag id */
-int ros_send_command_cb(struct ros_connection *conn, void (*callback)(struct ros_result *result), char *command, ...) {
-	int result;
-	int id;
-	struct ros_event *event = malloc(sizeof(struct ros_event));
-	char extra[120];
-	va_list ap;
+/* Compiles a field map for records of the given size. The fields are copied, their names are not */
+struct ros_schema *ros_schema_new(struct ros_schema_field *fields, int count, int size) {
+	struct ros_schema *schema = malloc(sizeof(struct ros_schema));
+	int i;
 
-	if (event == NULL) {
+	if (schema == NULL) {
 		fprintf(stderr, "Error allocating memory\n");
 		exit(1);
 	}
+	for (schema->index_size = 8; schema->index_size < count * 2; schema->index_size <<= 1);
+	schema->field = malloc(sizeof(struct ros_schema_field) * (count > 0 ? count : 1));
+	schema->namelen = malloc(sizeof(int) * (count > 0 ? count : 1));
+	schema->index = malloc(sizeof(int) * schema->index_size);
+	if (schema->field == NULL || schema->namelen == NULL || schema->index == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	schema->fields = count;
+	schema->size = size;
+	for (i = 0; i < schema->index_size; ++i) {
+		schema->index[i] = -1;
+	}
+	for (i = 0; i < count; ++i) {
+		unsigned int slot;
 
-	id = rand();
-	sprintf(event->tag, "%d", id);
-	sprintf(extra, ".tag=%s", event->tag);
-	event->callback = callback;
+		schema->field[i] = fields[i];
+		if (schema->field[i].name[0] == '=') {
+			schema->field[i].name++;
+		}
+		schema->namelen[i] = strlen(schema->field[i].name);
+		slot = ros_hash_key(schema->field[i].name, schema->namelen[i]);
+		while (schema->index[slot & (schema->index_size - 1)] >= 0) {
+			slot++;
+		}
+		schema->index[slot & (schema->index_size - 1)] = i;
+	}
+	return schema;
+}
 
-	ros_add_event(conn, event);
-	free(event);
+void ros_schema_free(struct ros_schema *schema) {
+	if (schema == NULL) {
+		return;
+	}
+	free(schema->field);
+	free(schema->namelen);
+	free(schema->index);
+	free(schema);
+}
 
-	va_start(ap, command);
-	result = ros_send_command_va(conn, extra, command, ap);
-	va_end(ap);
+/* Field number of an attribute, or -1. The field after the previous match is tried before the hash table */
+static int ros_schema_lookup(struct ros_schema *schema, const char *name, int namelen, int *next) {
+	unsigned int slot;
+	int i = *next;
 
-	return result > 0 ? id : 0;
+	if (i >= schema->fields || schema->namelen[i] != namelen || memcmp(schema->field[i].name, name, namelen) != 0) {
+		slot = ros_hash_key(name, namelen);
+		while ((i = schema->index[slot & (schema->index_size - 1)]) >= 0) {
+			if (schema->namelen[i] == namelen && memcmp(schema->field[i].name, name, namelen) == 0) {
+				break;
+			}
+			slot++;
+		}
+		if (i < 0) {
+			return -1;
+		}
+	}
+	*next = i + 1;
+	return i;
 }
 
-int ros_send_sentence_cb(struct ros_connection *conn, void (*callback)(struct ros_result *result), struct ros_sentence *sentence) {
-	int result;
-	int id;
-	struct ros_event *event = malloc(sizeof(struct ros_event));
-	char extra[120];
+/* Stores one attribute in the record if the schema has it. Returns 1 if it was stored */
+static int ros_schema_set(struct ros_schema *schema, void *record, const char *name, int namelen, char *value, int valuelen, int *next) {
+	struct ros_schema_field *field;
+	char *dst;
+	int i = ros_schema_lookup(schema, name, namelen, next);
 
-	if (event == NULL) {
-		fprintf(stderr, "Error allocating memory\n");
-		exit(1);
+	if (i < 0) {
+		return 0;
 	}
+	field = &schema->field[i];
+	dst = (char *)record + field->offset;
+	if (field->type == ROS_VALUE_STRING && field->size > 0) {
+		int len = valuelen < field->size - 1 ? valuelen : field->size - 1;
+		memcpy(dst, value, len);
+		dst[len] = '\0';
+		return 1;
+	}
+	return ros_parse_value(field->type, value, valuelen, dst);
+}
 
-	id = rand();
-	sprintf(event->tag, "%d", id);
-	sprintf(extra, ".tag=%s", event->tag);
-	event->callback = callback;
-
-	ros_add_event(conn, event);
-	free(event);
+/* Decodes a result into a record, which is cleared first. Returns the number of fields stored */
+int ros_decode(struct ros_result *result, struct ros_schema *schema, void *record) {
+	struct ros_sentence *sentence;
+	int i, next = 0, stored = 0;
 
-	ros_sentence_add(sentence, extra);
-	result = ros_send_sentence(conn, sentence);
+	if (result == NULL) {
+		return 0;
+	}
+	sentence = result->sentence;
+	memset(record, 0, schema->size);
+	for (i = 0; i < sentence->words; ++i) {
+		int keylen;
 
-	return result > 0 ? id : 0;
+		if (sentence->key != NULL && i < sentence->data_words) {
+			if (sentence->key[i] >= 0) {
+				stored += ros_schema_set(schema, record, sentence->keys->name[sentence->key[i]], sentence->keys->namelen[sentence->key[i]],
+					sentence->word[i], sentence->len[i], &next);
+			}
+			continue;
+		}
+		keylen = ros_word_keylen(sentence->word[i], sentence->len[i]);
+		if (keylen > 0 && sentence->word[i][0] == '=') {
+			stored += ros_schema_set(schema, record, sentence->word[i] + 1, keylen - 1,
+				sentence->word[i] + keylen + 1, sentence->len[i] - keylen - 1, &next);
+		}
+	}
+	return stored;
 }
 
+/* Decodes the current row of a cursor into a record, which is cleared first */
+int ros_cursor_decode(struct ros_cursor *cursor, struct ros_schema *schema, void *record) {
+	int i, next = 0, stored = 0;
 
-int ros_send_command(struct ros_connection *conn, char *command, ...) {
-	int result;
-	va_list ap;
-	va_start(ap, command);
-	result = ros_send_command_va(conn, NULL, command, ap);
-	va_end(ap);
-	return result;
+	memset(record, 0, schema->size);
+	if (cursor->reply != ROS_REPLY_RE) {
+		return 0;
+	}
+	for (i = 0; i < cursor->fields; ++i) {
+		stored += ros_schema_set(schema, record, cursor->field[i].key, cursor->field[i].keylen,
+			cursor->field[i].value, cursor->field[i].valuelen, &next);
+	}
+	return stored;
 }
 
-struct ros_result *ros_send_command_wait(struct ros_connection *conn, char *command, ...) {
-	int result;
+/* Reads up to max rows into an array of records. Returns how many, 0 once the command is done */
+int ros_cursor_read(struct ros_cursor *cursor, struct ros_schema *schema, void *records, int max) {
+	int rows = 0;
 
-	va_list ap;
-	va_start(ap, command);
-	result = ros_send_command_va(conn, NULL, command, ap);
-	va_end(ap);
+	while (rows < max && ros_cursor_next(cursor)) {
+		ros_cursor_decode(cursor, schema, (char *)records + (size_t)rows * schema->size);
+		rows++;
+	}
+	return rows;
+}
 
-	if (result == 0) {
-		return NULL;
+/* Writes the "=response=00<md5>" word answering a pre 6.43 login challenge, dst needs 45 bytes */
+static int ros_login_response(char *dst, char *challenge, char *password) {
+	unsigned char buffer[1 + 33];
+	char md5sum[17];
+	md5_state_t state;
+
+	memset(buffer, 0, sizeof(buffer));
+	if (!md5toBin(buffer + 1, challenge)) {
+		return 0;
 	}
-	/* Read packet */
-	return ros_read_packet(conn);
+
+	md5_init(&state);
+	md5_append(&state, buffer, 1);
+	md5_append(&state, (unsigned char *)password, strlen(password));
+	md5_append(&state, buffer + 1, 16);
+	md5_finish(&state, (md5_byte_t *)md5sum);
+
+	strcpy(dst, "=response=00");
+	bintomd5(dst + 12, (unsigned char *)md5sum);
+	return 1;
 }
 
-/* TODO: write with events */
 int ros_login(struct ros_connection *conn, char *username, char *password) {
 	int result;
-	unsigned char buffer[1024];
 	char *userWord;
 	char passWord[45];
 	char *challenge;
 	struct ros_result *res;
-	char md5sum[17];
-	md5_state_t state;
 
 	res = ros_send_command_wait(conn, "/login", NULL);
 
-	memset(buffer, 0, sizeof(buffer));
-
 	challenge = ros_get(res, "=ret");
-	if (challenge == NULL) {
+	if (challenge == NULL || !ros_login_response(passWord, challenge, password)) {
 		fprintf(stderr, "Error logging in. No challenge received\n");
-		exit(1);
+		ros_result_free(res);
+		return 0;
 	}
-	md5toBin(buffer + 1, challenge);
-
-	md5_init(&state);
-	md5_append(&state, buffer, 1);
-	md5_append(&state, (unsigned char *)password, strlen(password));
-	md5_append(&state, buffer + 1, 16);
-	md5_finish(&state, (md5_byte_t *)md5sum);
 	ros_result_free(res);
 
-	strcpy((char *)buffer, "00");
-	bintomd5((char *)buffer + 2, (unsigned char *)md5sum);
-
-	strcpy(passWord, "=response=");
-	strcat(passWord, (char *)buffer);
-	passWord[44] = '\0';
-
 	userWord = malloc(sizeof(char) * (6 + strlen(username) + 1));
+	if (userWord == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
 	strcpy(userWord, "=name=");
 	strcat(userWord, username);
 	userWord[6+strlen(username)] = 0;
@@ -855,4 +5210,169 @@ int ros_login(struct ros_connection *conn, char *username, char *password) {
 	return result;
 }
 
+/* Sends the /login sentence for the current step, response is only used for the last one */
+static int ros_login_send(struct ros_connection *conn, char *response) {
+	struct ros_login *login = conn->login;
+	char *args[4];
+	char tag[16] = ".tag=";
+	char *name = NULL, *password = NULL;
+	int num = 0, result;
+
+	login->tag = ros_next_tag(conn);
+	ros_format_tag(tag + 5, login->tag);
+
+	args[num++] = "/login";
+	if (login->step != ROS_LOGIN_STEP_CHALLENGE) {
+		name = malloc(6 + strlen(login->username) + 1);
+		if (name == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+		strcpy(name, "=name=");
+		strcat(name, login->username);
+		args[num++] = name;
+	}
+	if (login->step == ROS_LOGIN_STEP_PLAIN) {
+		password = malloc(10 + strlen(login->password) + 1);
+		if (password == NULL) {
+			fprintf(stderr, "Error allocating memory\n");
+			exit(1);
+		}
+		strcpy(password, "=password=");
+		strcat(password, login->password);
+		args[num++] = password;
+	} else if (login->step == ROS_LOGIN_STEP_RESPONSE) {
+		args[num++] = response;
+	}
+	args[num++] = tag;
+
+	result = ros_send_words(conn, args, NULL, num);
+	if (password != NULL) {
+		memset(password, 0, strlen(password));
+	}
+	free(password);
+	free(name);
+	return result;
+}
+
+static void ros_login_free(struct ros_login *login) {
+	memset(login->password, 0, strlen(login->password));
+	free(login);
+}
+
+static void ros_login_finish(struct ros_connection *conn, int success) {
+	struct ros_login *login = conn->login;
+	void (*done)(struct ros_connection *conn, int success) = login->done;
+
+	/* Report after dispatching, from ros_loop_run_once() or the runloop function, so done may free the connection */
+	if (conn->dispatch_depth > 0) {
+		login->result = success;
+		login->finished = 1;
+#ifndef _WIN32
+		if (conn->loop != NULL) {
+			ros_loop_timer_at(conn->loop, conn, 0);
+		}
+#endif
+		return;
+	}
+#ifndef _WIN32
+	if (conn->loop != NULL) {
+		ros_loop_timer_clear(conn->loop, conn);
+	}
+#endif
+	conn->login = NULL;
+	conn->login_tag = login->tag;
+	ros_login_free(login);
+	if (done != NULL) {
+		done(conn, success);
+	}
+}
+
+static void ros_login_reply(struct ros_connection *conn, struct ros_result *result) {
+	struct ros_login *login = conn->login;
+	char response[45];
+	char *challenge;
+
+	if (result->trap) {
+		login->trapped = 1;
+	}
+	if (result->fatal) {
+		ros_result_free(result);
+		ros_login_finish(conn, 0);
+		return;
+	}
+	if (!result->done) {
+		ros_result_free(result);
+		return;
+	}
+
+	challenge = ros_get(result, "=ret");
+	if (login->trapped || login->step == ROS_LOGIN_STEP_RESPONSE || challenge == NULL) {
+		ros_result_free(result);
+		ros_login_finish(conn, !login->trapped && login->step != ROS_LOGIN_STEP_CHALLENGE);
+		return;
+	}
+
+	/* Devices older than 6.43 answer the plaintext login with a challenge */
+	if ((login->step == ROS_LOGIN_STEP_PLAIN && login->method == ROS_LOGIN_PLAIN) ||
+		!ros_login_response(response, challenge, login->password)) {
+		ros_result_free(result);
+		ros_login_finish(conn, 0);
+		return;
+	}
+	ros_result_free(result);
+
+	login->step = ROS_LOGIN_STEP_RESPONSE;
+	if (!ros_login_send(conn, response)) {
+		ros_login_finish(conn, 0);
+	}
+}
+
+/* Non-blocking login, driven by the run loop like any other command. done is called once
+   with the outcome after dispatching is over, timeout in milliseconds applies while the
+   connection is in a ros_loop */
+int ros_login_async(struct ros_connection *conn, char *username, char *password, enum ros_login_method method, int timeout, void (*done)(struct ros_connection *conn, int success)) {
+	struct ros_login *login;
+	int ulen = strlen(username), plen = strlen(password);
+
+	if (conn->login != NULL) {
+		return 0;
+	}
+	login = malloc(sizeof(struct ros_login) + ulen + plen + 2);
+	if (login == NULL) {
+		fprintf(stderr, "Error allocating memory\n");
+		exit(1);
+	}
+	login->method = method;
+	login->step = method == ROS_LOGIN_CHALLENGE ? ROS_LOGIN_STEP_CHALLENGE : ROS_LOGIN_STEP_PLAIN;
+	login->tag = -1;
+	login->trapped = 0;
+	login->finished = 0;
+	login->timeout = timeout;
+	login->result = -1;
+	login->done = done;
+	login->username = (char *)(login + 1);
+	login->password = login->username + ulen + 1;
+	memcpy(login->username, username, ulen + 1);
+	memcpy(login->password, password, plen + 1);
+	conn->login = login;
+
+#ifndef _WIN32
+	if (conn->loop != NULL && !conn->connecting) {
+		ros_loop_timer_set(conn->loop, conn, timeout);
+	}
+#endif
+	if (!ros_login_send(conn, NULL)) {
+#ifndef _WIN32
+		if (conn->loop != NULL) {
+			ros_loop_timer_clear(conn->loop, conn);
+		}
+#endif
+		conn->login = NULL;
+		ros_login_free(login);
+		return 0;
+	}
+	return 1;
+}
+
 
@@ -22,6 +22,41 @@
 struct ros_sentence {
 	char **word;
 	int words;
+	int *len;
+	int max_words;
+	char arrays_heap;
+	/* Received sentences keep their words in one block */
+	char *data;
+	int data_words;
+	/* Key lookup table used by ros_get(), built on first use */
+	unsigned short *index;
+	int index_size;
+	int index_words;
+	char index_heap;
+	/* With interned keys, attribute words hold only the value and key has their key ids (-1 for others) */
+	int *key;
+	struct ros_keys *keys;
+};
+
+/* Interned attribute names, can be shared by connections on the same thread */
+struct ros_keys {
+	char **name;
+	int *namelen;
+	int count;
+	int max;
+	/* Key ids by name, an open addressing hash table */
+	int *index;
+	int index_size;
+	int refs;
+};
+
+enum ros_reply {
+	ROS_REPLY_UNKNOWN,
+	ROS_REPLY_DONE,
+	ROS_REPLY_RE,
+	ROS_REPLY_TRAP,
+	ROS_REPLY_FATAL,
+	ROS_REPLY_EMPTY
 };
 
 struct ros_result {
@@ -30,12 +65,151 @@ struct ros_result {
 	char re;
 	char trap;
 	char fatal;
+	enum ros_reply reply;
+	char storage;
+	/* Numeric .tag of the sentence, -1 if it has none */
+	int tag;
+	/* Connection the sentence was received on */
+	struct ros_connection *conn;
+};
+
+/* A field of the current cursor row, pointing into the receive buffer */
+struct ros_cursor_field {
+	char *key;
+	char *value;
+	int keylen;
+	int valuelen;
+};
+
+struct ros_cursor {
+	struct ros_connection *conn;
+	int tag;
+	/* Kind of the last sentence, and its fields */
+	enum ros_reply reply;
+	struct ros_cursor_field *field;
+	int fields;
+	int max_fields;
+	char finished;
+	/* Set when the command failed */
+	char *message;
+};
+
+/* One attribute of every row. The value of row r starts at data + offset[r] and is NUL terminated,
+   offset[r + 1] is where the next one starts. Bit r of valid is set if the row had the attribute */
+struct ros_column {
+	char *name;
+	int namelen;
+	char *data;
+	int data_len;
+	int data_size;
+	int *offset;
+	unsigned char *valid;
+};
+
+struct ros_table {
+	struct ros_column *column;
+	int columns;
+	int max_columns;
+	int rows;
+	int max_rows;
+	/* Column numbers by name, an open addressing hash table */
+	int *index;
+	int index_size;
+};
+
+enum ros_value_type {
+	ROS_VALUE_STRING,
+	ROS_VALUE_U64,
+	ROS_VALUE_I64,
+	ROS_VALUE_DOUBLE,
+	ROS_VALUE_BOOL,
+	/* long long nanoseconds */
+	ROS_VALUE_DURATION,
+	/* unsigned long long bits per second */
+	ROS_VALUE_RATE,
+	ROS_VALUE_IP
+};
+
+/* A binary address, family is 4 or 6. prefix is the full length if the value had none */
+struct ros_ip {
+	int family;
+	unsigned char addr[16];
+	int prefix;
+};
+
+/* An attribute for ros_get_fields(), decoded into value. found is set if it was there and parsed */
+struct ros_field {
+	char *key;
+	enum ros_value_type type;
+	void *value;
+	char found;
+};
+
+/* Where an attribute goes in a record, offset is usually offsetof() a member. For ROS_VALUE_STRING, size is
+   the size of the char array there and longer values are cut short, with size 0 a char * is stored instead */
+struct ros_schema_field {
+	char *name;
+	enum ros_value_type type;
+	int offset;
+	int size;
+};
+
+/* A compiled field map, with the fields by name in an open addressing hash table */
+struct ros_schema {
+	struct ros_schema_field *field;
+	int *namelen;
+	int fields;
+	/* Size of one record */
+	int size;
+	int *index;
+	int index_size;
+};
+
+struct ros_arena {
+	char *block;
+	int size;
+	int used;
+};
+
+#define ROS_POOL_CLASSES 12
+
+/* Free-lists of result blocks, can be shared by connections on the same thread */
+struct ros_pool {
+	struct ros_pool_block *free_list[ROS_POOL_CLASSES];
+	int free_count[ROS_POOL_CLASSES];
+	int max_free;
+	int refs;
+	unsigned long hits;
+	unsigned long misses;
 };
 
 struct ros_event {
-	char tag[100];
+	int tag;
 	void (*callback)(struct ros_result *result);
-	char inuse;
+	/* Replies go to this queue instead of the callback when set */
+	struct ros_queue *queue;
+	/* Counts against the pipeline window until its !done, sent is when it went in flight */
+	char pipelined;
+	long long sent;
+	struct ros_event *next;
+};
+
+enum ros_engine {
+	ROS_ENGINE_AUTO,
+	ROS_ENGINE_READINESS,
+	ROS_ENGINE_URING
+};
+
+enum ros_queue_policy {
+	ROS_QUEUE_BLOCK,
+	ROS_QUEUE_DROP_OLDEST,
+	ROS_QUEUE_DROP_NEWEST
+};
+
+enum ros_login_method {
+	ROS_LOGIN_AUTO,
+	ROS_LOGIN_PLAIN,
+	ROS_LOGIN_CHALLENGE
 };
 
 enum ros_type {
@@ -51,12 +225,59 @@ struct ros_connection {
 #else
 	int socket;
 #endif
-	unsigned char *buffer;
-	struct ros_event **events;
-	int max_events;
-	struct ros_result *event_result;
-	int expected_length;
-	int length;
+	/* Callbacks for tagged requests, an open addressing hash table keyed by tag */
+	struct ros_event **event_table;
+	int event_table_size;
+	int event_count;
+	struct ros_event_slab *event_slabs;
+	struct ros_event *free_events;
+	int next_tag;
+	unsigned char *inbuf;
+	int inbuf_size;
+	int inbuf_start;
+	int inbuf_end;
+	int scan_pos;
+	int scan_words;
+	struct ros_arena arena;
+	struct ros_result *arena_result;
+	int dispatch_depth;
+	struct ros_pool *pool;
+	struct ros_keys *keys;
+	unsigned char *outbuf;
+	int outbuf_size;
+	int outbuf_len;
+	int outbuf_pos;
+	/* Pipelined requests in flight, and encoded ones waiting for room in the window */
+	int window;
+	int inflight;
+	unsigned char *backlog;
+	int backlog_size;
+	int backlog_len;
+	int backlog_pos;
+	int backlog_count;
+	/* Adaptive window bounds, and time to !done of pipelined requests in microseconds */
+	int window_min;
+	int window_max;
+	int window_count;
+	long long rtt_min;
+	long long rtt_avg;
+	void *userdata;
+	struct ros_queue *queue;
+#ifndef _WIN32
+	struct ros_loop *loop;
+	void (*loop_callback)(struct ros_result *result);
+	int loop_index;
+	struct ros_uring_conn *uring;
+	struct ros_runtime_shard *shard;
+	char connecting;
+	long long deadline;
+	int timer_index;
+#endif
+	struct ros_login *login;
+	/* Tag of the last finished login, replies still arriving for it are dropped */
+	int login_tag;
+	/* Set by ros_disconnect(), which closes the connection after dispatching when called from a callback */
+	char closing;
 };
 
 #ifdef __cplusplus
@@ -67,24 +288,115 @@ extern "C"
 int ros_send_command(struct ros_connection *conn, char *command, ...);
 void ros_set_type(struct ros_connection *conn, enum ros_type type);
 int ros_runloop_once(struct ros_connection *conn, void (*callback)(struct ros_result *result));
+int ros_runloop_drain(struct ros_connection *conn, void (*callback)(struct ros_result *result));
 int ros_send_command_cb(struct ros_connection *conn, void (*callback)(struct ros_result *result), char *command, ...);
 int ros_send_sentence_cb(struct ros_connection *conn, void (*callback)(struct ros_result *result), struct ros_sentence *sentence);
+int ros_cancel_cb(struct ros_connection *conn, int id, void (*callback)(struct ros_result *result));
+int ros_cancel_many(struct ros_connection *conn, int *ids, int count, void (*callback)(struct ros_result *result));
+int ros_send_batch(struct ros_connection *conn, void (*callback)(struct ros_result *result), struct ros_sentence **sentences, int count, int *ids);
+void ros_set_window(struct ros_connection *conn, int window);
+void ros_set_adaptive_window(struct ros_connection *conn, int min, int max);
+int ros_pipeline_pending(struct ros_connection *conn);
+int ros_flush(struct ros_connection *conn);
+int ros_pending_output(struct ros_connection *conn);
+int ros_login_async(struct ros_connection *conn, char *username, char *password, enum ros_login_method method, int timeout, void (*done)(struct ros_connection *conn, int success));
+
+#ifndef _WIN32
+/* multi-connection event loop */
+struct ros_loop *ros_loop_new();
+struct ros_loop *ros_loop_new_engine(enum ros_engine engine);
+enum ros_engine ros_loop_engine(struct ros_loop *loop);
+int ros_loop_add(struct ros_loop *loop, struct ros_connection *conn, void (*callback)(struct ros_result *result));
+int ros_loop_remove(struct ros_loop *loop, struct ros_connection *conn);
+void ros_loop_set_disconnect(struct ros_loop *loop, void (*disconnect)(struct ros_connection *conn));
+int ros_loop_run_once(struct ros_loop *loop, int timeout);
+int ros_loop_count(struct ros_loop *loop);
+void ros_loop_free(struct ros_loop *loop);
+void ros_loop_wakeup(struct ros_loop *loop);
+struct ros_connection *ros_connect_async(char *address, int port);
+void ros_loop_set_connect(struct ros_loop *loop, void (*connected)(struct ros_connection *conn, int error), int timeout);
+void ros_loop_set_dial_limit(struct ros_loop *loop, int limit);
+int ros_loop_dial(struct ros_loop *loop, char *address, int port, void (*callback)(struct ros_result *result), void *userdata);
+int ros_loop_dialing(struct ros_loop *loop);
+
+/* multi-threaded runtime, one loop per thread */
+struct ros_runtime *ros_runtime_new(int threads, enum ros_engine engine);
+void ros_runtime_set_disconnect(struct ros_runtime *runtime, void (*disconnect)(struct ros_connection *conn));
+int ros_runtime_add(struct ros_runtime *runtime, struct ros_connection *conn, void (*callback)(struct ros_result *result));
+int ros_runtime_submit(struct ros_connection *conn, void (*callback)(struct ros_result *result), char **args, int num);
+int ros_runtime_close(struct ros_connection *conn);
+int ros_runtime_threads(struct ros_runtime *runtime);
+void ros_runtime_free(struct ros_runtime *runtime);
+
+/* result queues for consumer threads */
+struct ros_queue *ros_queue_new(int capacity, enum ros_queue_policy policy);
+int ros_queue_push(struct ros_queue *queue, struct ros_result *result);
+int ros_queue_pop(struct ros_queue *queue, struct ros_result **results, int max, int timeout);
+int ros_queue_length(struct ros_queue *queue);
+unsigned long ros_queue_dropped(struct ros_queue *queue);
+void ros_queue_free(struct ros_queue *queue);
+void ros_set_queue(struct ros_connection *conn, struct ros_queue *queue);
+int ros_send_command_queue(struct ros_connection *conn, struct ros_queue *queue, char *command, ...);
+int ros_send_sentence_queue(struct ros_connection *conn, struct ros_queue *queue, struct ros_sentence *sentence);
+#endif
 
 /* blocking functions */
 struct ros_result *ros_send_command_wait(struct ros_connection *conn, char *command, ...);
 struct ros_result *ros_read_packet(struct ros_connection *conn);
 int ros_login(struct ros_connection *conn, char *username, char *password);
 int ros_cancel(struct ros_connection *conn, int id);
+struct ros_cursor *ros_cursor_open(struct ros_connection *conn, char *command, ...);
+struct ros_cursor *ros_cursor_open_sentence(struct ros_connection *conn, struct ros_sentence *sentence);
+int ros_cursor_next(struct ros_cursor *cursor);
+char *ros_cursor_get(struct ros_cursor *cursor, char *key);
+void ros_cursor_close(struct ros_cursor *cursor);
+
+/* columnar result sets */
+struct ros_table *ros_table_new();
+int ros_table_add(struct ros_table *table, struct ros_result *result);
+int ros_table_add_cursor(struct ros_table *table, struct ros_cursor *cursor);
+int ros_table_column(struct ros_table *table, char *name);
+char *ros_table_get(struct ros_table *table, int column, int row);
+void ros_table_free(struct ros_table *table);
+
+/* decoding into records */
+struct ros_schema *ros_schema_new(struct ros_schema_field *fields, int count, int size);
+void ros_schema_free(struct ros_schema *schema);
+int ros_decode(struct ros_result *result, struct ros_schema *schema, void *record);
+int ros_cursor_decode(struct ros_cursor *cursor, struct ros_schema *schema, void *record);
+int ros_cursor_read(struct ros_cursor *cursor, struct ros_schema *schema, void *records, int max);
 
 /* common functions */
 struct ros_connection *ros_connect(char *address, int port);
 int ros_disconnect(struct ros_connection *conn);
 void ros_result_free(struct ros_result *result);
+void ros_set_arena(struct ros_connection *conn, int size);
+struct ros_pool *ros_pool_new(int max_free);
+void ros_pool_free(struct ros_pool *pool);
+void ros_set_pool(struct ros_connection *conn, struct ros_pool *pool);
+struct ros_keys *ros_keys_new();
+int ros_key(struct ros_keys *keys, char *name);
+void ros_set_keys(struct ros_connection *conn, struct ros_keys *keys);
+void ros_keys_free(struct ros_keys *keys);
 char *ros_get(struct ros_result *result, char *key);
+char *ros_get_n(struct ros_result *result, char *key, int keylen);
+char *ros_get_id(struct ros_result *result, int id);
 char *ros_get_tag(struct ros_result *result);
 
+/* typed values */
+int ros_get_u64(struct ros_result *result, char *key, unsigned long long *value);
+int ros_get_i64(struct ros_result *result, char *key, long long *value);
+int ros_get_double(struct ros_result *result, char *key, double *value);
+int ros_get_bool(struct ros_result *result, char *key, int *value);
+int ros_get_duration(struct ros_result *result, char *key, long long *ns);
+int ros_get_rate(struct ros_result *result, char *key, unsigned long long *bps);
+int ros_get_ip(struct ros_result *result, char *key, struct ros_ip *ip);
+int ros_get_fields(struct ros_result *result, struct ros_field *fields, int count);
+int ros_parse_value(enum ros_value_type type, char *value, int len, void *result);
+
 /* sentence functions */
 struct ros_sentence *ros_sentence_new();
+struct ros_sentence *ros_sentence_new_n(int words);
 void ros_sentence_free(struct ros_sentence *sentence);
 void ros_sentence_add(struct ros_sentence *sentence, char *word);
 